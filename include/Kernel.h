@@ -5,6 +5,7 @@
 #include <string>
 
 #include "Commands.h"
+#include "Module.h"
 #include "Paging.h"
 #include "Timer.h"
 #include "fs/FS.h"
@@ -44,6 +45,10 @@ class Kernel {
 	private:
 		std::string line;
 		std::vector<std::string> pieces;
+		/** Maps the kernel's code and data symbols to their addresses. Decoded from the kernel image on first use. */
+		std::map<std::string, uintptr_t> exports;
+
+		void addDriverTypes();
 
 	public:
 		static void __attribute__((noreturn)) panic(const std::string &);
@@ -58,6 +63,22 @@ class Kernel {
 		Paging::Tables &tables;
 		Thurisaz::Context context = {*this};
 		std::map<std::string, Thurisaz::Command> commands;
+		struct DriverType {
+			FS::DriverFactory factory;
+			/** Null for drivers built into the kernel. */
+			Module *owner = nullptr;
+		};
+		std::map<std::string, DriverType> driverTypes;
+		/** Storage devices registered by modules, addressable by name in the mount command. */
+		std::map<std::string, std::shared_ptr<StorageDevice>> devices;
+		std::map<std::string, std::unique_ptr<Module>> modules;
+		struct Descriptor {
+			std::shared_ptr<FS::Driver> driver;
+			/** The driver's own descriptor for the file. */
+			FS::fd_t fd;
+		};
+		/** Files opened with open(), indexed by kernel-wide descriptor. */
+		std::map<int, Descriptor> descriptors;
 		uintptr_t globalArea;
 		Timer timer;
 
@@ -68,6 +89,7 @@ class Kernel {
 		Kernel(Paging::Tables &tables_): tables(tables_) {
 			global_kernel = this;
 			Thurisaz::addCommands(commands);
+			addDriverTypes();
 			line.reserve(256);
 			asm("$g -> %0" : "=r"(globalArea));
 			asm("<io devcount> \n $r0 -> %0" : "=r"(context.driveCount));
@@ -79,11 +101,20 @@ class Kernel {
 		bool getDriver(const std::string &path, std::string &relative_out, std::shared_ptr<FS::Driver> &driver_out);
 		bool mount(const std::string &, std::shared_ptr<FS::Driver>);
 		bool unmount(const std::string &);
+		/** Flushes cached metadata on every mounted filesystem. Returns 0 or the first negative error code. */
+		int sync();
 		long getPID() const;
 		/** Starts a process. Be careful not to leak memory when calling this function, because it doesn't properly
 		 *  return. Deletes its argument. May return a negative error code if an error occurred. */
 		void __attribute__((noreturn)) startProcess(const std::string *);
 		void terminateProcess(long pid);
+		const std::map<std::string, uintptr_t> & getExports();
+		/** Loads a module from a .why file and runs its init function. Returns 0 or a negative error code. */
+		int loadModule(const std::string &path);
+		/** Returns 0 or a negative error code (-EBUSY if something still uses the module). */
+		int unloadModule(const std::string &name);
+		/** Returns nullptr if there's no driver type with the given name. */
+		std::shared_ptr<FS::Driver> makeDriver(const std::string &type, std::shared_ptr<Partition>);
 		void loop();
 		void timerCallback();
 
@@ -96,8 +127,18 @@ class Kernel {
 		int mkdir(const char *path, mode_t, uid_t, gid_t);
 		int truncate(const char *path, off_t size);
 		int rmdir(const char *path, bool recursive = false);
+		int compact(const char *path);
+		/** Defragments the filesystem containing a path. */
+		int defrag(const char *path, FS::FragStats *before = nullptr, FS::FragStats *after = nullptr);
+		/** Reserves space for a range of a file without changing its length. */
+		int fallocate(const char *path, off_t offset, off_t length);
 		int unlink(const char *path);
+		/** Returns a descriptor for use with the fd-based methods below or a negative error code. */
 		int open(const char *path);
+		int releaseFd(int fd);
+		int readFd(int fd, void *buffer, size_t size, off_t offset);
+		int writeFd(int fd, const char *buffer, size_t size, off_t offset);
+		int getsizeFd(int fd, size_t &out);
 		int read(const char *path, void *buffer, size_t size, off_t offset);
 		int readdir(const char *path, FS::DirFiller filler);
 		int getattr(const char *path, FS::FileStats &);
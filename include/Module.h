@@ -0,0 +1,56 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Commands.h"
+#include "fs/FS.h"
+
+class Kernel;
+struct StorageDevice;
+
+/** A .why object that has been relocated into kernel memory at runtime. Modules reference kernel code and data
+ *  through unknown symbols, which are resolved against the kernel's own symbol table when the module is loaded. */
+struct Module {
+	/** Called once the module has been relocated. A nonzero return value aborts the load. */
+	using InitFunction = long(*)(Module &);
+	/** Called before the module is unloaded, if the module defines it. */
+	using ExitFunction = void(*)(Module &);
+
+	static constexpr const char *INIT_SYMBOL = "thurisaz_module_init";
+	static constexpr const char *EXIT_SYMBOL = "thurisaz_module_exit";
+
+	Kernel &kernel;
+	std::string name;
+	std::string path;
+	/** Holds the module's code followed by its data. Allocated with new[]. */
+	char *memory = nullptr;
+	size_t size = 0;
+	ExitFunction exit = nullptr;
+	std::vector<std::string> commands;
+	std::vector<std::string> driverTypes;
+	std::vector<std::string> devices;
+	/** Drivers built by this module's factories. The module can't be unloaded while any of them are alive. */
+	std::vector<std::weak_ptr<FS::Driver>> drivers;
+
+	Module(Kernel &kernel_, const std::string &name_, const std::string &path_, char *memory_, size_t size_):
+		kernel(kernel_), name(name_), path(path_), memory(memory_), size(size_) {}
+
+	Module(const Module &) = delete;
+	Module(Module &&) = delete;
+	~Module();
+
+	Module & operator=(const Module &) = delete;
+	Module & operator=(Module &&) = delete;
+
+	/** These return false if the name is already taken. */
+	bool addCommand(const std::string &, const Thurisaz::Command &);
+	bool addDriverType(const std::string &, const FS::DriverFactory &);
+	bool addDevice(const std::string &, std::shared_ptr<StorageDevice>);
+
+	/** Returns true if something outside the module still refers to code or data inside it. */
+	bool busy() const;
+	/** Removes everything the module registered with the kernel. */
+	void unregister();
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cerrno>
 #include <cstddef>
 #include <cstdint>
 #include <ctime>
@@ -17,6 +18,10 @@ namespace FS {
 	using inode_t = size_t;
 	using DirFiller = std::function<void(const char *, off_t)>;
 
+	class Driver;
+	/** Constructs a filesystem driver for a partition. Registered with the kernel under a type name. */
+	using DriverFactory = std::function<std::shared_ptr<Driver>(std::shared_ptr<Partition>)>;
+
 	std::string simplifyPath(std::string cwd, std::string);
 	std::string simplifyPath(std::string);
 
@@ -58,6 +63,16 @@ namespace FS {
 		uint64_t flags = 0;
 	};
 
+	struct FragStats {
+		/** Number of files and directories with at least one block. */
+		size_t files = 0;
+		/** Total number of runs of consecutive blocks across all of them. */
+		size_t extents = 0;
+		/** Number of files and directories stored in a single run. */
+		size_t contiguous = 0;
+		size_t blocks = 0;
+	};
+
 	class Driver {
 		public:
 			std::shared_ptr<Partition> partition;
@@ -76,7 +91,12 @@ namespace FS {
 			virtual int ftruncate(const char *path, off_t size) = 0;
 			virtual int rmdir(const char *path, bool recursive = false) = 0;
 			virtual int unlink(const char *path) = 0;
+			/** Returns a nonnegative descriptor for use with the methods below or a negative error code. */
 			virtual int open(const char *path) = 0;
+			virtual int releaseFd(fd_t) = 0;
+			virtual int readFd(fd_t, void *buffer, size_t size, off_t offset) = 0;
+			virtual int writeFd(fd_t, const char *buffer, size_t size, off_t offset) = 0;
+			virtual int getsizeFd(fd_t, size_t &out) = 0;
 			virtual int read(const char *path, void *buffer, size_t size, off_t offset) = 0;
 			virtual int readdir(const char *path, DirFiller filler) = 0;
 			virtual int getattr(const char *path, FileStats &) = 0;
@@ -88,6 +108,16 @@ namespace FS {
 			/** Does this partition contain a valid instance of the filesystem? */
 			virtual bool verify() = 0;
 			virtual void cleanup() = 0;
+			/** Writes any cached metadata back to the partition. Returns 0 or a negative error code. */
+			virtual int sync() { return 0; }
+			/** Packs a directory's entries together and releases the space freed by removed entries. */
+			virtual int compact(const char *) { return -ENOTSUP; }
+			/** Moves fragmented files and directories into contiguous runs. before and after receive fragmentation
+			 *  statistics for the whole filesystem if they aren't null. */
+			virtual int defrag(FragStats *, FragStats *) { return -ENOTSUP; }
+			/** Reserves space for a range of a file up front so that writing to it doesn't have to allocate. The
+			 *  file's length doesn't change. */
+			virtual int fallocate(const char *, off_t, off_t) { return -ENOTSUP; }
 
 		protected:
 			Driver() = delete;
@@ -4,8 +4,12 @@
 
 #include <cstdint>
 #include <ctime>
+#include <functional>
+#include <map>
+#include <set>
 #include <string>
 #include <string.h>
+#include <unordered_map>
 #include <vector>
 
 #include "fs/FS.h"
@@ -22,6 +26,13 @@ namespace ThornFAT {
 
 	constexpr block_t UNUSABLE = -1;
 	constexpr block_t FINAL    = -2;
+	/** Stands for an unallocated block of a sparse file in a block map. Never stored in the FAT. */
+	constexpr block_t HOLE     = -3;
+	/** Set in the FAT entry of a hole marker: a block in a chain whose data is the number of unallocated blocks
+	 *  that take its place in the file. The rest of the entry links to the next block as usual. */
+	constexpr block_t HOLE_FLAG = 1 << 30;
+	/** The start block of a file whose data is stored in its directory entry after the name. */
+	constexpr block_t INLINE   = -4;
 
 	struct Superblock {
 		uint32_t magic;
@@ -60,6 +71,7 @@ namespace ThornFAT {
 		mode_t modes = 0;
 		uid_t uid;
 		gid_t gid;
+		/** Holds the name hash (see nameHash). */
 		char padding[8] = {0}; // update if THORNFAT_PATH_MAX changes so that sizeof(DirEntry) is a multiple of 64
 
 		DirEntry() = default;
@@ -68,14 +80,84 @@ namespace ThornFAT {
 		DirEntry & operator=(const DirEntry &);
 		bool isFile() const { return type == FileType::File; }
 		bool isDirectory() const { return type == FileType::Directory; }
+		bool isInline() const { return startBlock == INLINE; }
+		/** Returns the start of the inline data area: the first 8-byte boundary after the name's terminator. */
+		char * inlineData();
+		const char * inlineData() const;
+		/** Returns the number of bytes between inlineData() and the end of the name field. */
+		size_t inlineSpace() const;
 		void reset();
+		static uint64_t hashName(const char *);
+		/** Returns the hash of the name stored in the padding, or 0 for entries written before names were hashed. */
+		uint64_t nameHash() const;
+		/** Stores the hash of the current name. Call this whenever the name changes. */
+		void updateHash();
+		/** Checks whether the entry's name is search, whose hash is search_hash. Entries with a stored hash are
+		 *  rejected with one comparison; otherwise the names are compared a word at a time up to the word holding the
+		 *  terminator. search must be zero-padded. */
+		bool nameMatches(const Filename &search, uint64_t search_hash) const;
 		operator std::string() const;
 		void print() const;
 	};
 
 	static_assert(sizeof(DirEntry) % 64 == 0);
 
+	/** One slot of the directory index. The first slot of the index holds an IndexHeader instead. */
+	struct IndexBucket {
+		/** Start block of the directory containing the entry. 0 if the slot is empty, UNUSABLE if it was removed. */
+		block_t parent;
+		/** See ThornFATDriver::indexHash. */
+		uint32_t nameHash;
+		/** Offset of the directory entry. */
+		int64_t offset;
+	};
+
+	struct IndexHeader {
+		uint32_t magic;
+		/** Number of slots that aren't empty, including removed ones. */
+		uint32_t used;
+		/** Number of slots that point to entries. */
+		uint64_t live;
+	};
+
+	static_assert(sizeof(IndexBucket) == sizeof(IndexHeader));
+
+	/** The v2 on-disk directory entry. Names that don't fit in name are stored whole in a name block shared with other
+	 *  long names, and the first COMPACT_NAME_MAX characters are kept in name. */
+	struct CompactEntry {
+		Times times;
+		uint64_t length;
+		block_t startBlock;
+		/** Block holding the full name if it's too long for name, or 0. */
+		block_t nameBlock;
+		uint32_t modes;
+		uint32_t uid;
+		uint32_t gid;
+		uint8_t type;
+		uint8_t nameLength;
+		char padding[8];
+		/** Index of the first unit of nameBlock holding the full name (see NAME_UNIT). */
+		uint16_t nameUnit;
+		char name[16];
+	};
+
+	static_assert(sizeof(CompactEntry) == 80);
+
+	constexpr size_t COMPACT_NAME_MAX = sizeof(CompactEntry::name);
+	/** Name blocks are split into units of this many bytes. A long name takes as many consecutive units as it needs,
+	 *  and the first unit of each name block holds a bitmap of the units in use. */
+	constexpr size_t NAME_UNIT = 32;
+	/** The bitmap covers this many units. Any more in a large block go unused. */
+	constexpr size_t NAME_UNITS_MAX = 64;
+
+	/** Volumes with 320-byte directory entries. */
 	constexpr uint32_t MAGIC = 0xfa91283e;
+	/** Volumes with CompactEntry directory entries. */
+	constexpr uint32_t MAGIC_V2 = 0xfa91283f;
+	constexpr uint32_t INDEX_MAGIC = 0x78646e69;
+	/** The directory index is a file with this name in the root directory's third slot. No path can name it. */
+	constexpr const char *INDEX_NAME = "/index";
+	constexpr size_t INDEX_MIN_SLOTS = 256;
 	constexpr int NEWFILE_SKIP_MAX = 4;
 	constexpr int OVERFLOW_MAX = 32;
 	constexpr size_t MINBLOCKS = 3;
@@ -83,7 +165,12 @@ namespace ThornFAT {
 	class ThornFATDriver: public FS::Driver {
 		public:
 			Superblock superblock;
+			/** Number of free blocks, or -1 if the free map hasn't been built. Maintained by writeFAT. */
 			ssize_t blocksFree = -1;
+			/** One bit per block; set bits are free blocks. Empty until buildFreeMap() is called. */
+			std::vector<uint64_t> freeMap;
+			/** Where findFreeBlock starts looking, so that allocation doesn't rescan the start of the disk. */
+			size_t freeCursor = 0;
 			DirEntry root;
 			size_t writeOffset = 0;
 			/** Ugly hack to avoid allocating memory on the heap because I'm too lazy to deal with freeing it. */
@@ -108,13 +195,104 @@ namespace ThornFAT {
 			int find(fd_t, const char *, DirEntry *out = nullptr, off_t * = nullptr, bool get_parent = false,
 			         std::string *last_name = nullptr);
 
+			static std::string dentryKey(off_t parent_offset, const std::string &name);
+			/** Caches the result of looking up a name. Pass nullptr to record that the name doesn't exist. */
+			void cacheDentry(const std::string &key, const DirEntry *, off_t offset);
+			void forgetDentry(const std::string &key);
+			/** Called when a directory entry is written. Refreshes the cached copy, or drops it if the entry was freed
+			 *  or renamed. */
+			void updateDentry(const DirEntry &, off_t offset);
+			void clearDentries();
+
+			struct DirInfo;
+
+			/** Returns the hash the directory index uses for a name: the low half of DirEntry::hashName, so entries
+			 *  and buckets agree. */
+			static uint32_t indexHash(const char *name);
+			/** Returns true for entries that are part of the filesystem's own bookkeeping and shouldn't be listed. */
+			static bool isHidden(const DirEntry &);
+
+			/** Finds the directory index if the volume has one. Returns false for volumes without an index. */
+			bool loadIndex();
+			/** Creates an empty directory index in a freshly made filesystem and fills it. */
+			bool createIndex();
+			/** Rewrites the index from a scan of the whole tree, resizing it to fit. Returns 0 or a negative error
+			 *  code. */
+			int rebuildIndex();
+			size_t indexSlots() const;
+			size_t indexProbeStart(block_t parent, uint32_t hash) const;
+			int readBucket(size_t slot, IndexBucket &);
+			int writeBucket(size_t slot, const IndexBucket &);
+			/** Looks a name up in the index. Returns 1 if it was found, 0 if it definitely isn't in the directory or -1
+			 *  if the index can't answer and the directory has to be scanned. */
+			int indexLookup(block_t parent, const std::string &name, DirEntry &out, off_t &out_offset);
+			void indexInsert(block_t parent, const char *name, off_t offset);
+			void indexRemove(block_t parent, const char *name, off_t offset);
+
+			/** Returns the cached slot information for a directory, scanning the directory first if it isn't cached or
+			 *  is out of date. Returns nullptr if the directory couldn't be read. */
+			DirInfo * dirInfo(const DirEntry &dir);
+			/** Marks an entry slot as free in the directory containing the given path, if that directory is cached, and
+			 *  removes the entry from the directory index. */
+			void releaseSlot(const char *path, off_t offset);
+			/** Marks an entry slot as no longer free. */
+			void claimSlot(off_t offset);
+
+			/** Moves a directory's live entries to the front, shortens it and frees the blocks it no longer needs. Open
+			 *  descriptors, cached dentries and block maps, and the directory index follow the moved entries. Returns 0
+			 *  or a negative error code. */
+			int compactDir(DirEntry &dir, off_t dir_offset);
+			/** Frees the blocks at the end of a directory's chain that its length doesn't need. */
+			void trimDir(const DirEntry &dir);
+			/** Compacts the directory containing a path if enough of its entries are dead. Called after removals. */
+			void maybeCompact(const char *path);
+
+			/** Adds a chain's extent counts to a set of statistics. */
+			void addFragStats(FS::FragStats &, block_t start);
+			int fragmentation(FS::FragStats &);
+			/** Moves a chain into a contiguous run if it isn't one already and there's a run big enough, then points
+			 *  the entry at it. Returns 0 or a negative error code; being unable to move a chain isn't an error. */
+			int relocateChain(DirEntry &entry, off_t offset);
+			/** Relocates the chains of a directory's entries and recurses into its subdirectories. parent_start is
+			 *  the current start block of the directory's parent, for fixing up "..". */
+			int defragDir(const DirEntry &dir, block_t parent_start);
+			/** Updates everything that remembers entry offsets after a directory's blocks have moved. */
+			void remapOffsets(const std::vector<block_t> &from, const std::vector<block_t> &to);
+
 			/** Removes a chain of blocks from the file allocation table. 
 			 *  Returns the number of blocks that were freed. */
 			size_t forget(block_t start);
 
+			/** Returns the cached list of blocks in the chain starting at a given block, building it first if
+			 *  necessary. Hole markers are expanded into HOLE entries. Empty if the start block is free or invalid. */
+			std::vector<block_t> & blockMap(block_t start);
+
+			/** Discards the cached block map for a chain. Call this whenever a chain changes in a way that resize
+			 *  doesn't already account for. */
+			void forgetBlockMap(block_t start);
+
 			/** Returns the length of a chain of blocks. Returns the length of the chain (including the first block). */
 			size_t chainLength(block_t start);
 
+			/** Size of a directory entry on disk: sizeof(DirEntry) for v1 volumes or sizeof(CompactEntry) for v2. */
+			size_t entrySize() const;
+			/** Returns how many bytes of data a file can keep in its directory entry, given its name. */
+			size_t inlineCapacity(const DirEntry &) const;
+			/** Moves an inline file's data into a newly allocated block without saving the entry. data is the file's
+			 *  current contents, in case they're no longer in the entry. Returns 0 or a negative error code. */
+			int spill(DirEntry &file, const char *data);
+			/** Converts an on-disk entry at a given offset to a DirEntry. If search is given, a v2 long name is only
+			 *  read from its name block when the stored hash and prefix agree with search. Otherwise out gets just the
+			 *  prefix, which can't match. Returns 0 or a negative error code. */
+			int decodeEntry(const void *raw, off_t offset, DirEntry &out, const Filename *search = nullptr,
+			                uint64_t search_hash = 0);
+			/** Reads and decodes the entry at a given offset. Returns 0 or a negative error code. */
+			int loadEntry(DirEntry &, off_t offset, const Filename *search = nullptr, uint64_t search_hash = 0);
+			/** Encodes and writes an entry without touching any caches. Returns 0 or a negative error code. */
+			int storeEntry(const DirEntry &, off_t offset);
+			/** Zeroes the entry at a given offset. Returns 0 or a negative error code. */
+			int clearEntry(off_t offset);
+
 			/** Writes a directory entry at a given offset. 
 			 *  Returns 0 if the operation was successful or a negative error code otherwise. */
 			int writeEntry(const DirEntry &, off_t);
@@ -134,12 +312,34 @@ namespace ThornFAT {
 			int readDir(const DirEntry &dir, std::vector<DirEntry> &entries, std::vector<off_t> *offsets = nullptr,
 			            int *first_index = nullptr);
 
-			/** Reads the raw bytes for a given directory entry and stores them in an array.
-			 *  @param file  A reference to a directory entry struct.
-			 *  @param out   A reference to a vector of bytes that will be filled with the read bytes.
-			 *  @param count An optional pointer that will be set to the number of bytes read.
-			 *  @return Returns 0 if the operation succeeded or a negative error code otherwise. */
-			int readFile(const DirEntry &file, std::vector<uint8_t> &out, size_t *count = nullptr);
+			/** Called for each entry in a directory along with its offset. Returning false stops the iteration. */
+			using DirVisitor = std::function<bool(const DirEntry &, off_t)>;
+
+			/** Visits a directory's entries one block at a time, so only a block's worth of entries is in memory at
+			 *  once. search is passed on to decodeEntry for lookups that only care about one name. Returns 0 if the
+			 *  directory was read (even if the visitor stopped early) or a negative error code otherwise. */
+			int iterateDir(const DirEntry &dir, const DirVisitor &visitor, const Filename *search = nullptr,
+			               uint64_t search_hash = 0);
+
+			/** Reads or writes part of a file's data, issuing one device request per run of physically consecutive
+			 *  blocks in its chain. Holes and anything past the end of the chain read as zeroes; they can't be
+			 *  written to.
+			 *  @param block    The file's start block.
+			 *  @param offset   The offset within the file to start at.
+			 *  @param buffer   The buffer to read into or write from.
+			 *  @param size     The number of bytes to transfer.
+			 *  @param writing  Whether to write to the partition instead of reading from it.
+			 *  @param last_out An optional pointer that will be set to the last block touched.
+			 *  @return Returns the number of bytes transferred (short if the chain ends early) or a negative error
+			 *          code. */
+			ssize_t transfer(block_t block, size_t offset, void *buffer, size_t size, bool writing,
+			                 block_t *last_out = nullptr);
+
+			/** Reads from a file whose directory entry has already been found. */
+			int readData(DirEntry &file, off_t file_offset, void *buffer, size_t size, off_t offset);
+
+			/** Writes to a file whose directory entry has already been found, growing it if necessary. */
+			int writeData(DirEntry &file, off_t file_offset, const char *buffer, size_t size, off_t offset);
 
 			/** Creates a new file.
 			 *  @param path              The path of the new file to create.
@@ -167,21 +367,53 @@ namespace ThornFAT {
 			int remove(const char *path);
 
 			/** Attempts to resize a file or directory. If the new size is smaller than the old size, the leftover data
-			 *  will be zeroed out. This modifies both the directory entry argument and the data on the disk.
+			 *  will be zeroed out; if it's larger, the added range is left as a hole. This modifies both the directory
+			 *  entry argument and the data on the disk.
 			 *  @param file        A reference to a directory entry.
 			 *  @param file_offset The starting offset of the file.
 			 *  @param new_size    The new size of the file.
 			 *  @return Returns 0 if the operation succeeded or a negative error code otherwise. */
 			int resize(DirEntry &file, off_t file_offset, size_t new_size);
 
+			/** Allocates whatever blocks a write to a range of a file needs and extends its length to cover the range
+			 *  without saving the entry. Parts of new blocks the write won't cover are zeroed, as is any allocated
+			 *  space between the old end of the file and the start of the range. Returns 0 or a negative error code. */
+			int allocateRange(DirEntry &file, size_t offset, size_t size);
+
+			/** Allocates blocks for the holes and missing blocks among a file's logical blocks first through last, as
+			 *  one contiguous run if possible, and links them into its chain. Each new block's index in the file and
+			 *  block number are stored in added. Returns 0 or a negative error code. */
+			int fillBlocks(DirEntry &file, size_t first, size_t last, std::vector<std::pair<size_t, block_t>> &added);
+
+			/** Rewrites a file's chain in the FAT to match a block map that may contain holes, reusing the chain's
+			 *  existing hole markers where possible. Trailing holes are dropped since they're implied by the file's
+			 *  length. Updates the file's start block but doesn't save the entry. Returns 0 or a negative error code. */
+			int encodeChain(DirEntry &file, std::vector<block_t> map);
+
+			/** Writes zeroes over a range of bytes within a file's existing chain. Holes are skipped. */
+			int zeroRange(const DirEntry &file, size_t start, size_t end);
+
 			/** Zeroes out the free space at the end of a file. Useful when truncating a file.
 			 *  Returns 0 if the operation was successful or a negative error code otherwise. */
 			int zeroOutFree(const DirEntry &file, size_t new_size);
 
-			/** Attempts to find a free block in a file allocation table.
-			 *  @return Returns the index of the first free block if any were found; -1 otherwise. */
+			/** Attempts to find a free block in a file allocation table, starting at the allocation cursor.
+			 *  @return Returns the index of a free block if any were found; -1 otherwise. */
 			block_t findFreeBlock();
 
+			/** Returns whether the free map says a block is free. */
+			bool blockFree(size_t block) const;
+
+			/** Allocates blocks and links them into a chain that ends in FINAL. The blocks are taken from a single
+			 *  free run if possible: the run starting at preferred (usually the block after the end of the file being
+			 *  grown), otherwise the smallest run that's large enough. If no run is large enough, the largest runs are
+			 *  combined.
+			 *  @param count     The number of blocks to allocate.
+			 *  @param preferred The block the allocation should ideally start at, or a nonpositive number for none.
+			 *  @param out       A vector that will be filled with the allocated blocks in chain order.
+			 *  @return Returns 0 if the operation succeeded or a negative error code otherwise. */
+			int allocateBlocks(size_t count, block_t preferred, std::vector<block_t> &out);
+
 			/** Determines whether a directory is empty. Returns 0 if the directory isn't empty, 1 if it is or a
 			 *  negative error code if an error occurred. */
 			int directoryEmpty(const DirEntry &dir);
@@ -190,8 +422,147 @@ namespace ThornFAT {
 			void updateName(DirEntry &, const char *);
 			void updateName(DirEntry &, const std::string &);
 
+			/** Number of FAT entries per cache chunk. */
+			static constexpr size_t FAT_CHUNK_SIZE = 1024;
+			/** FATs with at most this many entries are read in full the first time the cache is used. */
+			static constexpr size_t FAT_PRELOAD_MAX = 64 * 1024;
+
+			struct FATChunk {
+				/** Empty until the chunk has been read from disk. */
+				std::vector<block_t> entries;
+				std::vector<bool> dirty;
+				size_t dirtyCount = 0;
+			};
+
+			/** Maximum number of dentry cache entries before the cache is emptied. */
+			static constexpr size_t DCACHE_MAX = 512;
+
+			struct Dentry {
+				DirEntry entry;
+				off_t offset;
+				/** True if the name is known not to exist in the directory. */
+				bool negative;
+			};
+
+			/** Caches name lookups. Keys are the offset of the parent directory's entry and the name, joined by a
+			 *  slash (see dentryKey). */
+			std::unordered_map<std::string, Dentry> dcache;
+			/** Maps the offsets of positive dcache entries to their keys so writeEntry can keep them current. */
+			std::unordered_map<off_t, std::string> dcacheOffsets;
+
+			struct OpenFile {
+				DirEntry entry;
+				/** Offset of the file's directory entry. */
+				off_t offset;
+			};
+
+			/** Files opened with open(), indexed by descriptor. writeEntry keeps their entries current. */
+			std::map<fd_t, OpenFile> openFiles;
+
+			/** Whether the volume uses v2 (CompactEntry) directory entries. */
+			bool compactEntries = false;
+			struct NameSlot {
+				block_t block;
+				/** Index of the first unit in the block. */
+				uint16_t unit;
+				uint16_t units;
+			};
+
+			/** Maps the offsets of v2 entries seen so far to where their long names are stored. */
+			std::unordered_map<off_t, NameSlot> nameSlots;
+			/** Unit bitmaps of name blocks known to have room for more names. */
+			std::unordered_map<block_t, uint64_t> nameBlockUsage;
+
+			/** Finds room for a long name in a name block, allocating a new block if none has enough. Returns 0 or a
+			 *  negative error code. */
+			int allocateName(size_t length, NameSlot &out);
+			/** Gives a long name's units back and frees its block if nothing else is left in it. Returns 0 or a
+			 *  negative error code. */
+			int releaseName(const NameSlot &);
+			/** Releases the long name of the entry at a given offset, if it has one. */
+			void forgetName(off_t offset);
+
+			/** Whether loadIndex has looked for the directory index yet. */
+			bool indexChecked = false;
+			/** Offset of the index's entry, or -1 if the volume has no index. */
+			off_t indexOffset = -1;
+			DirEntry indexEntry;
+			IndexHeader indexHeader;
+			/** Set when indexHeader has changed since it was last written. Flushed by sync(). */
+			bool indexHeaderDirty = false;
+
+			/** Directories longer than a block are compacted automatically once this percentage of their entries are
+			 *  dead. */
+			static constexpr size_t COMPACT_DEAD_PERCENT = 50;
+			/** Cleared while a caller holds entry offsets that compaction would invalidate. */
+			bool autoCompact = true;
+
+			/** Maximum number of directories whose slot information is kept at once. */
+			static constexpr size_t DIRINFO_MAX = 32;
+
+			/** Lets newFile add an entry to a directory without scanning it. */
+			struct DirInfo {
+				/** The directory length the rest of the information is valid for. */
+				size_t length = 0;
+				/** Offsets of freed entries within the directory's length. */
+				std::set<off_t> freeSlots;
+				/** The last block in the directory's chain. */
+				block_t tailBlock = 0;
+				/** Value of dirInfoClock when the information was last used. */
+				uint64_t lastUsed = 0;
+			};
+
+			/** Maps a directory's start block to its slot information. The least recently used entry is evicted to
+			 *  make room for a new one. */
+			std::map<block_t, DirInfo> dirInfos;
+			uint64_t dirInfoClock = 0;
+
+			/** Maximum number of chains whose block maps are kept at once. */
+			static constexpr size_t BLOCKMAP_MAX = 32;
+
+			struct CachedBlockMap {
+				std::vector<block_t> blocks;
+				/** Value of blockMapClock when the map was last used. */
+				uint64_t lastUsed = 0;
+			};
+
+			/** Maps a chain's start block to the blocks in the chain, in order. The least recently used map is
+			 *  evicted to make room for a new one. */
+			std::map<block_t, CachedBlockMap> blockMaps;
+			uint64_t blockMapClock = 0;
+
+			/** Returns the cached block map for a chain, making room for it if it isn't cached yet. A new map starts
+			 *  out empty. */
+			std::vector<block_t> & blockMapSlot(block_t start);
+
+			/** In-memory copy of the FAT, loaded a chunk at a time. Writes stay here until flushFAT() is called. */
+			std::vector<FATChunk> fatCache;
+
+			/** Maps a hole marker to the number of blocks it stands for. */
+			std::unordered_map<block_t, uint64_t> holeCounts;
+
+			/** Returns the next block in a chain. Hole markers' flags are masked off. */
 			block_t readFAT(size_t block_offset);
+			/** Returns a FAT entry as it's stored. */
+			block_t rawFAT(size_t block_offset);
 			int writeFAT(block_t block, size_t block_offset);
+			/** Returns whether a block in a chain is a hole marker. */
+			bool holeMarker(block_t block);
+			/** Returns the number of blocks a hole marker stands for, or 0 if it couldn't be read. */
+			uint64_t holeCount(block_t block);
+
+			/** Returns the number of entries the on-disk FAT has room for. */
+			size_t fatEntries() const;
+			/** Returns a pointer to the cached copy of a FAT entry, loading its chunk if necessary. Returns nullptr if
+			 *  the entry lies outside the FAT or couldn't be read. */
+			block_t * cachedFAT(size_t block_offset);
+			/** Reads a range of cache chunks from disk with a single read. */
+			int loadFATChunks(size_t first_chunk, size_t chunk_count);
+			/** Writes every dirty FAT entry to disk, one write per run of consecutive dirty entries, even when a run spans
+			 *  several chunks. */
+			int flushFAT();
+			/** Drops the FAT cache without writing anything back. Used after the FAT has been rewritten on disk. */
+			void resetFATCache();
 
 			bool initFAT(size_t table_size, size_t block_size);
 			bool initData(size_t table_size, size_t block_size);
@@ -199,9 +570,13 @@ namespace ThornFAT {
 
 			bool hasFree(const size_t);
 			ssize_t countFree();
+			/** Builds the free map and free block count in a single pass over the FAT if that hasn't been done yet.
+			 *  Returns false if the FAT couldn't be read. */
+			bool buildFreeMap();
 
 			bool checkBlock(block_t);
 
+			/** Checks whether a directory entry is unused. Answered from the entry and the free map, not the disk. */
 			bool isFree(const DirEntry &);
 			bool hasStuff(const DirEntry &);
 			bool isRoot(const DirEntry &);
@@ -267,6 +642,10 @@ namespace ThornFAT {
 			virtual int rmdir(const char *path, bool recursive = false) override;
 			virtual int unlink(const char *path) override;
 			virtual int open(const char *path) override;
+			virtual int releaseFd(fd_t) override;
+			virtual int readFd(fd_t, void *buffer, size_t size, off_t offset) override;
+			virtual int writeFd(fd_t, const char *buffer, size_t size, off_t offset) override;
+			virtual int getsizeFd(fd_t, size_t &out) override;
 			virtual int read(const char *path, void *buffer, size_t size, off_t offset) override;
 			virtual int readdir(const char *path, FS::DirFiller filler) override;
 			virtual int getattr(const char *path, FS::FileStats &) override;
@@ -276,8 +655,18 @@ namespace ThornFAT {
 			virtual int exists(const char *path) override;
 			virtual bool verify() override;
 			virtual void cleanup() override {}
-			bool make(uint32_t block_size);
+			virtual int sync() override;
+			virtual int compact(const char *path) override;
+			virtual int defrag(FS::FragStats *before, FS::FragStats *after) override;
+			virtual int fallocate(const char *path, off_t offset, off_t length) override;
+			/** Formats the partition. With dir_index, the new filesystem gets a directory index, which keeps name
+			 *  lookups from scanning large directories. With compact, it uses the v2 directory entry format. */
+			bool make(uint32_t block_size, bool dir_index = false, bool compact = false);
+			/** Converts a v1 volume to the v2 directory entry format in place, dropping free entries along the way.
+			 *  Returns 0 or a negative error code. Not safe against interruption. */
+			int convert();
 
 			ThornFATDriver(std::shared_ptr<Partition>);
+			~ThornFATDriver();
 	};
 }
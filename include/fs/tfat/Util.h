@@ -342,7 +342,6 @@ static const char BigSegfault[] = BIG_SEGFAULT A_RESET SEGFAULT_EXTRA;
 #define WRENTRYH     DIMH("write_entry")
 #define RSUPERBLOCKH      "rsuperblock"
 #define ZEROOUTFREEH      "zerooutfree"
-#define FILEREADH           "readFile"
 #define FATFINDH     A_RESET ICHS("       find") A_DIM
 #define NEWFILEH     A_RESET  IPS("    newfile") A_DIM
 #define RESIZEH      A_RESET  ICS("     resize") A_DIM
@@ -393,7 +392,7 @@ inline int IS_X(const char *p, const char *x) {
 // #define DEBUG_LOCKS  // Whether to print messages when mutexes are locked or unlocked.
 
 // When a directory is found to have more FAT blocks allocated to it than its size requires,
-// SHRINK_DIRS will make file_read free up the extra FAT blocks.
+// SHRINK_DIRS will make compactDir free up the extra FAT blocks even when no entries move.
 #define SHRINK_DIRS
 
 //////// Some methods are really spammy, so they're silent unless specifically enabled with their corresponding flags.
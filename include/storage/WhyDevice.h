@@ -5,7 +5,7 @@ struct WhyDevice: StorageDevice {
 	WhyDevice(long index_);
 	ssize_t read(void *buffer, size_t bytes, size_t byte_offset) override;
 	ssize_t write(const void *buffer, size_t bytes, size_t byte_offset) override;
-	long size() const;
+	long size() const override;
 	static size_t count();
 	bool operator==(const StorageDevice &) const override;
 };
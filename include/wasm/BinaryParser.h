@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -10,11 +11,21 @@
 namespace Wasmc {
 	class BinaryParser {
 		public:
+			/** Full decodes everything. Load decodes only what relocation needs: symbols holds addresses and types
+			 *  without labels, symbolIndices stays empty and the instructions and debug data are left in rawCode and
+			 *  rawDebugData. Link is Load plus symbol labels, for binaries whose unknown symbols have to be resolved
+			 *  by name. */
+			enum class Mode {Full, Load, Link};
+			/** Returns the absolute address of the unknown symbol at the given index in symbols. */
+			using Resolver = std::function<Long(size_t symbol_index)>;
+
 			std::vector<Long> raw, rawMeta, rawCode, rawData, rawSymbols, rawDebugData, rawRelocation;
 			std::string name, version, author, orcid;
 			std::vector<SymbolTableEntry> symbols;
 			std::map<std::string, size_t> symbolIndices;
+			/** Decoded instructions. Only a Full parse fills this; loading only needs rawCode. */
 			std::vector<std::unique_ptr<AnyBase>> code;
+			/** Only a Full parse fills this; the others leave the debug data in rawDebugData. */
 			std::vector<std::shared_ptr<DebugEntry>> debugData;
 			std::vector<RelocationData> relocationData;
 			Offsets offsets;
@@ -30,11 +41,14 @@ namespace Wasmc {
 			BinaryParser & operator=(BinaryParser &&) = default;
 
 			static AnyBase * parse(Long);
+			/** Decodes the symbol table stored in words [begin, end). Useful for images that are already in memory. */
+			static std::vector<SymbolTableEntry> readSymbols(const Long *words, size_t begin, size_t end,
+			                                                 bool with_labels = true);
 
-			void parse();
-			/** Applies relocation to the code and data sections (updates rawCode and rawData). */
-			void applyRelocation(size_t code_offset, size_t data_offset);
-
+			void parse(Mode = Mode::Full);
+			/** Applies relocation to the code and data sections (updates rawCode and rawData). If a resolver is
+			 *  given, relocations against unknown symbols use the address it returns. */
+			void applyRelocation(size_t code_offset, size_t data_offset, const Resolver & = nullptr);
 			decltype(debugData) copyDebugData() const;
 
 			Long getMetaLength() const;
@@ -54,10 +68,17 @@ namespace Wasmc {
 
 		private:
 			std::vector<Long> slice(size_t begin, size_t end);
-			void extractSymbols();
+
+			void extractSymbols(bool with_labels = true);
 			std::vector<std::shared_ptr<DebugEntry>> getDebugData() const;
 			std::vector<RelocationData> getRelocationData() const;
 
 			static std::string toString(Long);
+			/** Replaces the immediate field of an encoded I- or J-type instruction. Returns false if the instruction
+			 *  has no immediate field. */
+			static bool patchImmediate(Long &instruction, Long value);
+			/** Overwrites width bytes (4 or 8) at byte_offset in a little-endian word array. Returns false if that
+			 *  runs past the end. */
+			static bool patchBytes(std::vector<Long> &words, size_t byte_offset, Long value, size_t width);
 	};
 }
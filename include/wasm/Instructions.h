@@ -1,8 +1,8 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <map>
-#include <set>
 #include <string>
 
 namespace Wasmc {
@@ -10,13 +10,49 @@ namespace Wasmc {
 	using Funct  = uint16_t;
 
 	constexpr uint16_t FUNCT_MAX = 4095;
+	constexpr size_t OPCODE_MAX = 4095;
 
-	extern std::set<Opcode> RTYPES, ITYPES, JTYPES;
-	extern std::map<std::string, Opcode> OPCODES;
-	extern std::map<int, std::string> TOKEN_INSTRUCTIONS_R, TOKEN_INSTRUCTIONS_I;
-	extern std::map<std::string, std::string> UNSIGNED_EQUIVALENTS;
-	extern std::map<std::string, Funct> FUNCTS;
-	extern std::map<int, Funct> TOKEN_FUNCTS;
+	enum class OpcodeClass: uint8_t {Invalid = 0, Nop, R, I, J};
+
+	/** Maps every possible opcode to the format of its instructions. */
+	struct OpcodeClassTable {
+		OpcodeClass classes[OPCODE_MAX + 1] {};
+		constexpr OpcodeClass operator[](Opcode opcode) const { return classes[opcode & OPCODE_MAX]; }
+	};
+
+	/** The location of a field within an encoded instruction. */
+	struct Field {
+		int shift;
+		int width;
+
+		constexpr uint64_t mask() const { return ((uint64_t(1) << width) - 1) << shift; }
+		constexpr uint64_t extract(uint64_t instruction) const {
+			return (instruction >> shift) & ((uint64_t(1) << width) - 1);
+		}
+		constexpr uint64_t insert(uint64_t value) const { return (value << shift) & mask(); }
+		constexpr bool operator==(const Field &other) const { return shift == other.shift && width == other.width; }
+	};
+
+	constexpr Field OPCODE_FIELD {52, 12};
+
+	namespace RField {
+		constexpr Field Funct {0, 12}, Flags {12, 2}, Condition {14, 4}, Rd {31, 7}, Rs {38, 7}, Rt {45, 7};
+	}
+
+	namespace IField {
+		constexpr Field Immediate {0, 32}, Rd {32, 7}, Rs {39, 7}, Flags {46, 2}, Condition {48, 4};
+	}
+
+	namespace JField {
+		constexpr Field Immediate {0, 32}, Flags {32, 2}, Condition {34, 4}, Link {44, 1}, Rs {45, 7};
+	}
+
+	constexpr Opcode getOpcode(uint64_t instruction) {
+		return static_cast<Opcode>(OPCODE_FIELD.extract(instruction));
+	}
+
+	/** Built at compile time; replaces the RTYPES, ITYPES and JTYPES sets. */
+	extern const OpcodeClassTable OPCODE_CLASSES;
 
 	constexpr Opcode OP_NOP    = 0b000000000000;
 	constexpr Opcode OP_ADD    = 0b000000000001;
@@ -11,6 +11,19 @@
 #include "wasm/BinaryParser.h"
 
 namespace Thurisaz {
+	/** Returns the mounted driver for a partition's device or null if the device isn't mounted. Each driver caches the
+	 *  FAT separately, so the shell has to go through this one instead of opening a second driver on the device. */
+	static std::shared_ptr<FS::Driver> findMounted(Context &context, const Partition &partition,
+	                                               std::string *mountpoint_out = nullptr) {
+		for (const auto &[mountpoint, driver]: context.kernel.mounts)
+			if (*driver->partition == partition) {
+				if (mountpoint_out)
+					*mountpoint_out = mountpoint;
+				return driver;
+			}
+		return nullptr;
+	}
+
 	int runCommand(const std::map<std::string, Command> &commands, Context &context,
 	               const std::vector<std::string> &pieces) {
 		if (!pieces.empty()) {
@@ -86,17 +99,58 @@ namespace Thurisaz {
 			return 0;
 		}, "[drive]");
 
-		commands.emplace("make", Command(0, 0, [](Context &context, const std::vector<std::string> &) -> long {
-			context.partition = std::make_shared<Partition>(context.device, 0, context.device->size());
+		commands.emplace("make", Command(0, 2, [](Context &context, const std::vector<std::string> &pieces) -> long {
+			bool dir_index = false, compact = false;
+			for (size_t i = 1; i < pieces.size(); ++i) {
+				if (pieces[i] == "dirindex") {
+					dir_index = true;
+				} else if (pieces[i] == "v2") {
+					compact = true;
+				} else {
+					printf("Unknown option: %s\n", pieces[i].c_str());
+					return 1;
+				}
+			}
+			auto partition = std::make_shared<Partition>(context.device, 0, context.device->size());
+			std::string mountpoint;
+			if (findMounted(context, *partition, &mountpoint)) {
+				printf("Drive is mounted at %s. Unmount it first.\n", mountpoint.c_str());
+				return 1;
+			}
+			context.partition = partition;
 			context.driver = std::make_shared<ThornFAT::ThornFATDriver>(context.partition);
 			strprint("ThornFAT driver instantiated.\n");
-			const bool success = context.driver->make(sizeof(ThornFAT::DirEntry) * 5);
+			const bool success = context.driver->make(sizeof(ThornFAT::DirEntry) * 5, dir_index, compact);
 			printf("ThornFAT creation %s.\n", success? "succeeded" : "failed");
 			return success? 0 : 1;
-		}, "").setDeviceNeeded());
+		}, "[dirindex] [v2]").setDeviceNeeded());
+
+		commands.emplace("convert", Command(0, 0, [](Context &context, const std::vector<std::string> &) -> long {
+			int status = context.driver->convert();
+			// Unless the shell's driver is also mounted, nothing else will flush what a failed conversion left cached.
+			const int sync_status = context.driver->sync();
+			if (status == 0)
+				status = sync_status;
+			if (status != 0) {
+				printf("Conversion failed: %d\n", -status);
+				return 1;
+			}
+			strprint("Converted to ThornFAT v2.\n");
+			return 0;
+		}, "").setDriverNeeded());
 
 		commands.emplace("driver", Command(0, 0, [](Context &context, const std::vector<std::string> &) -> long {
-			context.partition = std::make_shared<Partition>(context.device, 0, context.device->size());
+			auto partition = std::make_shared<Partition>(context.device, 0, context.device->size());
+			std::string mountpoint;
+			auto mounted = std::dynamic_pointer_cast<ThornFAT::ThornFATDriver>(findMounted(context, *partition,
+				&mountpoint));
+			if (mounted) {
+				context.partition = mounted->partition;
+				context.driver = mounted;
+				printf("Using the ThornFAT driver mounted at %s.\n", mountpoint.c_str());
+				return 0;
+			}
+			context.partition = partition;
 			context.driver = std::make_shared<ThornFAT::ThornFATDriver>(context.partition);
 			context.driver->getRoot(nullptr, true);
 			strprint("ThornFAT driver instantiated.\n");
@@ -143,16 +197,24 @@ namespace Thurisaz {
 		commands.try_emplace("read", 1, 1, [](Context &context, const std::vector<std::string> &pieces) -> long {
 			const std::string path = pieces[1][0] == '/'? pieces[1] : FS::simplifyPath(context.cwd,
 				pieces[1]);
+			const int fd = context.kernel.open(path.c_str());
+			if (fd < 0) {
+				printf("open failed: %ld\n", -long(fd));
+				return -fd;
+			}
+
 			size_t size;
-			ssize_t status = context.kernel.getsize(path.c_str(), size);
+			ssize_t status = context.kernel.getsizeFd(fd, size);
 			if (status != 0) {
 				printf("getsize failed: %ld\n", -status);
+				context.kernel.releaseFd(fd);
 				return -status;
 			}
 
 			std::string data;
 			data.resize(size);
-			status = context.kernel.read(path.c_str(), &data[0], size, 0);
+			status = context.kernel.readFd(fd, &data[0], size, 0);
+			context.kernel.releaseFd(fd);
 			if (status < 0) {
 				printf("read failed: %ld\n", -status);
 				return -status;
@@ -175,17 +237,26 @@ namespace Thurisaz {
 			{
 				strprint("Reading data.\n");
 				const std::string path = FS::simplifyPath(context.cwd, pieces[1]);
-				status = context.kernel.getsize(path.c_str(), size);
+				const int fd = context.kernel.open(path.c_str());
+				if (fd < 0) {
+					printf("open failed: %ld\n", -long(fd));
+					return -fd;
+				}
+
+				status = context.kernel.getsizeFd(fd, size);
 				if (status != 0) {
 					printf("getsize failed: %ld\n", -status);
+					context.kernel.releaseFd(fd);
 					return -status;
 				}
 
 				data = new std::string;
 				data->resize(size);
-				status = context.kernel.read(path.c_str(), &(*data)[0], size, 0);
+				status = context.kernel.readFd(fd, &(*data)[0], size, 0);
+				context.kernel.releaseFd(fd);
 				if (status < 0) {
 					printf("read failed: %ld\n", -status);
+					delete data;
 					return -status;
 				}
 			}
@@ -290,29 +361,46 @@ namespace Thurisaz {
 			return 0;
 		});
 
-		commands.try_emplace("mount", 2, 2, [](Context &context, const std::vector<std::string> &pieces) -> long {
-			long index = 0;
-			const bool fail1 = !parseLong(pieces[1], index);
-			const bool fail2 = index < 0;
-			const bool fail3 = context.driveCount <= index;
-			if (fail1 || fail2 || fail3) {
-				printf("Invalid device index (\"%s\" -> %ld). Drive count is %ld. %d%d%d\n", pieces[1].c_str(), index,
-					context.driveCount, fail1, fail2, fail3);
-				return 1;
+		commands.try_emplace("mount", 2, 3, [](Context &context, const std::vector<std::string> &pieces) -> long {
+			std::shared_ptr<StorageDevice> device;
+			auto named = context.kernel.devices.find(pieces[1]);
+			if (named != context.kernel.devices.end()) {
+				device = named->second;
+			} else {
+				long index = 0;
+				const bool fail1 = !parseLong(pieces[1], index);
+				const bool fail2 = index < 0;
+				const bool fail3 = context.driveCount <= index;
+				if (fail1 || fail2 || fail3) {
+					printf("Invalid device index (\"%s\" -> %ld). Drive count is %ld. %d%d%d\n", pieces[1].c_str(),
+						index, context.driveCount, fail1, fail2, fail3);
+					return 1;
+				}
+				device = std::make_shared<WhyDevice>(index);
 			}
 
+			const std::string type = pieces.size() == 4? pieces[3] : "thornfat";
 			const std::string mountpoint = FS::simplifyPath(context.cwd, pieces[2]);
-			auto device = std::make_shared<WhyDevice>(index);
 			auto partition = std::make_shared<Partition>(device, 0, device->size());
-			auto driver = std::make_shared<ThornFAT::ThornFATDriver>(partition);
+			std::shared_ptr<FS::Driver> driver;
+			// If the shell already has a driver open on the device, mount that one so that there's only one FAT cache.
+			if (type == "thornfat" && context.driver && *context.driver->partition == *partition)
+				driver = context.driver;
+			else
+				driver = context.kernel.makeDriver(type, partition);
+			if (!driver) {
+				printf("Unknown filesystem type: %s\n", type.c_str());
+				return 1;
+			}
+
 			if (!context.kernel.mount(mountpoint, driver)) {
 				printf("Mounting at %s failed.\n", mountpoint.c_str());
 				return 1;
 			}
 
-			printf("Mounted device %lu at %s.\n", index, mountpoint.c_str());
+			printf("Mounted %s at %s.\n", pieces[1].c_str(), mountpoint.c_str());
 			return 0;
-		});
+		}, "<device> <path> [type]");
 
 		commands.try_emplace("mounts", 0, 0, [](Context &context, const std::vector<std::string> &) -> long {
 			if (context.kernel.mounts.empty())
@@ -335,7 +423,91 @@ namespace Thurisaz {
 			return 1;
 		});
 
-		commands.try_emplace("halt", 0, 0, [](Context &, const std::vector<std::string> &) -> long {
+		commands.try_emplace("insmod", 1, 1, [](Context &context, const std::vector<std::string> &pieces) -> long {
+			const std::string path = FS::simplifyPath(context.cwd, pieces[1]);
+			const int status = context.kernel.loadModule(path);
+			if (status != 0) {
+				printf("insmod failed: %ld\n", -long(status));
+				return -status;
+			}
+
+			printf("Loaded %s.\n", path.c_str());
+			return 0;
+		}, "<path>");
+
+		commands.try_emplace("rmmod", 1, 1, [](Context &context, const std::vector<std::string> &pieces) -> long {
+			const int status = context.kernel.unloadModule(pieces[1]);
+			if (status != 0) {
+				printf("rmmod failed: %ld\n", -long(status));
+				return -status;
+			}
+
+			printf("Unloaded %s.\n", pieces[1].c_str());
+			return 0;
+		}, "<name>");
+
+		commands.try_emplace("lsmod", 0, 0, [](Context &context, const std::vector<std::string> &) -> long {
+			if (context.kernel.modules.empty())
+				strprint("No modules are loaded.\n");
+			else
+				for (const auto &[name, module]: context.kernel.modules)
+					printf("%s (%lu bytes) from %s\n", name.c_str(), module->size, module->path.c_str());
+			return 0;
+		});
+
+		commands.try_emplace("compact", 1, 1, [](Context &context, const std::vector<std::string> &pieces) -> long {
+			const int status = context.kernel.compact(FS::simplifyPath(context.cwd, pieces[1]).c_str());
+			if (status != 0)
+				printf("compact error: %ld\n", -long(status));
+			return -status;
+		}, "<directory>");
+
+		commands.try_emplace("defrag", 0, 1, [](Context &context, const std::vector<std::string> &pieces) -> long {
+			const std::string path = 1 < pieces.size()? FS::simplifyPath(context.cwd, pieces[1]) : context.cwd;
+			FS::FragStats before, after;
+			const int status = context.kernel.defrag(path.c_str(), &before, &after);
+			if (status != 0) {
+				printf("defrag error: %ld\n", -long(status));
+				return -status;
+			}
+
+			auto report = [](const char *when, const FS::FragStats &stats) {
+				// Extents per file in hundredths, to stay clear of floating point.
+				const size_t per_file = stats.files == 0? 0 : stats.extents * 100 / stats.files;
+				printf("%s: %lu file%s, %lu block%s, %lu extent%s (%lu.%02lu per file), %lu%% contiguous\n", when,
+					stats.files, stats.files == 1? "" : "s", stats.blocks, stats.blocks == 1? "" : "s", stats.extents,
+					stats.extents == 1? "" : "s", per_file / 100, per_file % 100,
+					stats.files == 0? 100 : stats.contiguous * 100 / stats.files);
+			};
+
+			report("Before", before);
+			report("After", after);
+			return 0;
+		}, "[path]");
+
+		commands.try_emplace("fallocate", 3, 3, [](Context &context, const std::vector<std::string> &pieces) -> long {
+			uint64_t offset, length;
+			if (!parseUlong(pieces[2], offset) || !parseUlong(pieces[3], length)) {
+				strprint("Invalid number.\n");
+				return 1;
+			}
+
+			const std::string path = FS::simplifyPath(context.cwd, pieces[1]);
+			const int status = context.kernel.fallocate(path.c_str(), offset, length);
+			if (status != 0)
+				printf("fallocate error: %ld\n", -long(status));
+			return -status;
+		}, "<path> <offset> <length>");
+
+		commands.try_emplace("sync", 0, 0, [](Context &context, const std::vector<std::string> &) -> long {
+			const int status = context.kernel.sync();
+			if (status != 0)
+				printf("sync failed: %ld\n", -long(status));
+			return -status;
+		});
+
+		commands.try_emplace("halt", 0, 0, [](Context &context, const std::vector<std::string> &) -> long {
+			context.kernel.sync();
 			strprint("Halted.\n");
 			asm("<halt>");
 			return 0;
@@ -4,6 +4,7 @@
 #include "Kernel.h"
 #include "Print.h"
 #include "util.h"
+#include "fs/tfat/ThornFAT.h"
 #include "wasm/BinaryParser.h"
 
 Kernel *global_kernel = nullptr;
@@ -67,21 +68,44 @@ bool Kernel::mount(const std::string &path, std::shared_ptr<FS::Driver> driver)
 
 bool Kernel::unmount(const std::string &path) {
 	const std::string simplified = FS::simplifyPath(path);
+	std::string found;
 	if (mounts.count(simplified) != 0) {
-		mounts.erase(simplified);
-		return true;
+		found = simplified;
+	} else {
+		const size_t size = simplified.size();
+		for (const auto &[mountpoint, driver]: mounts) {
+			const size_t msize = mountpoint.size();
+			if (msize < size && simplified.substr(0, msize) == mountpoint) {
+				found = mountpoint;
+				break;
+			}
+		}
 	}
 
-	const size_t size = simplified.size();
+	if (found.empty())
+		return false;
+
+	std::shared_ptr<FS::Driver> driver = mounts.at(found);
+	// Descriptors don't survive an unmount.
+	for (auto iter = descriptors.begin(); iter != descriptors.end();)
+		if (iter->second.driver == driver) {
+			driver->releaseFd(iter->second.fd);
+			descriptors.erase(iter++);
+		} else
+			++iter;
+	driver->sync();
+	mounts.erase(found);
+	return true;
+}
+
+int Kernel::sync() {
+	int out = 0;
 	for (const auto &[mountpoint, driver]: mounts) {
-		const size_t msize = mountpoint.size();
-		if (msize < size && simplified.substr(0, msize) == mountpoint) {
-			mounts.erase(mountpoint);
-			return true;
-		}
+		const int status = driver->sync();
+		if (status < 0 && out == 0)
+			out = status;
 	}
-
-	return false;
+	return out;
 }
 
 long Kernel::getPID() const {
@@ -95,7 +119,7 @@ void Kernel::startProcess(const std::string *text) {
 	std::unique_ptr<Wasmc::BinaryParser> parser = std::make_unique<Wasmc::BinaryParser>(*text);
 	delete text;
 	strprint("Parsing.\n");
-	parser->parse();
+	parser->parse(Wasmc::BinaryParser::Mode::Load);
 	strprint("Calculating.\n");
 	const size_t code_offset = Paging::PageSize;
 	const size_t code_length = parser->getCodeLength();
@@ -204,6 +228,150 @@ void Kernel::terminateProcess(long pid) {
 	processes.erase(pid);
 }
 
+const std::map<std::string, uintptr_t> & Kernel::getExports() {
+	if (exports.empty()) {
+		// The kernel image starts at physical address 0, which is mapped at pmmStart, and its header is still intact.
+		// The global area begins right after the image, so that's as far as the header's offsets can point.
+		const Wasmc::Long *image = (const Wasmc::Long *) tables.pmmStart;
+		const size_t image_size = globalArea;
+		if (image_size < 6 * sizeof(Wasmc::Long) || image[0] < 6 * sizeof(Wasmc::Long) || image[1] < image[0] ||
+		    image[2] < image[1] || image[3] < image[2] || image_size < image[3]) {
+			strprint("Kernel image header is invalid; no symbols exported.\n");
+			return exports;
+		}
+
+		const uintptr_t code_start = tables.pmmStart + image[0];
+		const uintptr_t data_start = tables.pmmStart + image[1];
+		for (const auto &symbol: Wasmc::BinaryParser::readSymbols(image, image[2] / 8, image[3] / 8))
+			if (symbol.type == Wasmc::SymbolEnum::Code)
+				exports.try_emplace(symbol.label, code_start + symbol.address);
+			else if (symbol.type == Wasmc::SymbolEnum::Data)
+				exports.try_emplace(symbol.label, data_start + symbol.address);
+	}
+
+	return exports;
+}
+
+int Kernel::loadModule(const std::string &path) {
+	std::unique_ptr<Wasmc::BinaryParser> parser;
+
+	{
+		size_t size;
+		int status = getsize(path.c_str(), size);
+		if (status != 0)
+			return status;
+		std::string text;
+		text.resize(size);
+		status = read(path.c_str(), &text[0], size, 0);
+		if (status < 0)
+			return status;
+		parser = std::make_unique<Wasmc::BinaryParser>(text);
+	}
+
+	parser->parse(Wasmc::BinaryParser::Mode::Link);
+
+	if (modules.count(parser->name) != 0)
+		return -EEXIST;
+
+	// Resolve every import before allocating anything so that a missing symbol fails cleanly.
+	const auto &kernel_symbols = getExports();
+	std::vector<uintptr_t> imports(parser->symbols.size(), 0);
+	for (size_t i = 0, max = parser->symbols.size(); i < max; ++i) {
+		const Wasmc::SymbolTableEntry &symbol = parser->symbols[i];
+		if (Wasmc::isUnknown(symbol.type)) {
+			auto iter = kernel_symbols.find(symbol.label);
+			if (iter == kernel_symbols.end()) {
+				printf("Unresolved symbol in %s: %s\n", path.c_str(), symbol.label.c_str());
+				return -ENOENT;
+			}
+			imports[i] = iter->second;
+		}
+	}
+
+	// Entry points are looked up by label among the module's own code symbols.
+	auto find_entry = [&](const char *label, uintptr_t &offset_out) {
+		auto iter = parser->symbolIndices.find(label);
+		if (iter == parser->symbolIndices.end() || parser->symbols[iter->second].type != Wasmc::SymbolEnum::Code)
+			return false;
+		offset_out = parser->symbols[iter->second].address;
+		return true;
+	};
+
+	uintptr_t init_offset = 0, exit_offset = 0;
+	if (!find_entry(Module::INIT_SYMBOL, init_offset)) {
+		printf("%s has no %s function.\n", path.c_str(), Module::INIT_SYMBOL);
+		return -ENOEXEC;
+	}
+	const bool has_exit = find_entry(Module::EXIT_SYMBOL, exit_offset);
+
+	// Code comes first and is a whole number of instructions, so the data that follows it stays 8-byte aligned.
+	const size_t code_length = parser->getCodeLength();
+	const size_t data_length = parser->getDataLength();
+	char *memory = new char[code_length + data_length];
+
+	const uintptr_t code_start = uintptr_t(memory);
+	const uintptr_t data_start = code_start + code_length;
+	parser->applyRelocation(code_start, data_start, [&](size_t index) {
+		return imports[index];
+	});
+
+	for (size_t i = 0, max = parser->rawCode.size(); i < max; ++i)
+		((uint64_t *) code_start)[i] = parser->rawCode[i];
+	for (size_t i = 0, max = parser->rawData.size(); i < max; ++i)
+		((uint64_t *) data_start)[i] = parser->rawData[i];
+
+	const std::string name = parser->name;
+	parser.reset();
+
+	auto &module = modules.try_emplace(name, std::make_unique<Module>(*this, name, path, memory,
+		code_length + data_length)).first->second;
+	if (has_exit)
+		module->exit = Module::ExitFunction(code_start + exit_offset);
+
+	const long status = Module::InitFunction(code_start + init_offset)(*module);
+	if (status != 0) {
+		printf("%s failed to initialize: %ld\n", name.c_str(), status);
+		module->unregister();
+		modules.erase(name);
+		return -ECANCELED;
+	}
+
+	return 0;
+}
+
+int Kernel::unloadModule(const std::string &name) {
+	auto iter = modules.find(name);
+	if (iter == modules.end())
+		return -ENOENT;
+
+	Module &module = *iter->second;
+	if (module.busy())
+		return -EBUSY;
+
+	if (module.exit)
+		module.exit(module);
+	module.unregister();
+	modules.erase(iter);
+	return 0;
+}
+
+std::shared_ptr<FS::Driver> Kernel::makeDriver(const std::string &type, std::shared_ptr<Partition> partition) {
+	auto iter = driverTypes.find(type);
+	if (iter == driverTypes.end())
+		return nullptr;
+
+	auto driver = iter->second.factory(partition);
+	if (driver && iter->second.owner)
+		iter->second.owner->drivers.push_back(driver);
+	return driver;
+}
+
+void Kernel::addDriverTypes() {
+	driverTypes.try_emplace("thornfat", DriverType {[](std::shared_ptr<Partition> partition) {
+		return std::make_shared<ThornFAT::ThornFATDriver>(partition);
+	}});
+}
+
 void Kernel::loop() {
 	strprint("\e[32m$\e[39;1m ");
 
@@ -254,6 +422,8 @@ void Kernel::loop() {
 		}
 
 		keybrd_index = -1;
+		// Nothing else to do until the next interrupt, so this is a good time to write back cached metadata.
+		sync();
 		asm("<rest>");
 	}
 }
@@ -335,6 +505,30 @@ int Kernel::rmdir(const char *path, bool recursive) {
 	return -ENODEV;
 }
 
+int Kernel::compact(const char *path) {
+	std::string relative, path_str(path);
+	std::shared_ptr<FS::Driver> driver;
+	if (getDriver(path_str, relative, driver))
+		return driver->compact(relative.c_str());
+	return -ENODEV;
+}
+
+int Kernel::defrag(const char *path, FS::FragStats *before, FS::FragStats *after) {
+	std::string relative, path_str(path);
+	std::shared_ptr<FS::Driver> driver;
+	if (getDriver(path_str, relative, driver))
+		return driver->defrag(before, after);
+	return -ENODEV;
+}
+
+int Kernel::fallocate(const char *path, off_t offset, off_t length) {
+	std::string relative, path_str(path);
+	std::shared_ptr<FS::Driver> driver;
+	if (getDriver(path_str, relative, driver))
+		return driver->fallocate(relative.c_str(), offset, length);
+	return -ENODEV;
+}
+
 int Kernel::unlink(const char *path) {
 	std::string relative, path_str(path);
 	std::shared_ptr<FS::Driver> driver;
@@ -346,9 +540,52 @@ int Kernel::unlink(const char *path) {
 int Kernel::open(const char *path) {
 	std::string relative, path_str(path);
 	std::shared_ptr<FS::Driver> driver;
-	if (getDriver(path_str, relative, driver))
-		return driver->open(relative.c_str());
-	return -ENODEV;
+	if (!getDriver(path_str, relative, driver))
+		return -ENODEV;
+
+	const int driver_fd = driver->open(relative.c_str());
+	if (driver_fd < 0)
+		return driver_fd;
+
+	int fd = 0;
+	for (const auto &[used, descriptor]: descriptors) {
+		if (used != fd)
+			break;
+		++fd;
+	}
+
+	descriptors.try_emplace(fd, Descriptor {driver, FS::fd_t(driver_fd)});
+	return fd;
+}
+
+int Kernel::releaseFd(int fd) {
+	auto iter = descriptors.find(fd);
+	if (iter == descriptors.end())
+		return -EBADF;
+	const int status = iter->second.driver->releaseFd(iter->second.fd);
+	descriptors.erase(iter);
+	return status;
+}
+
+int Kernel::readFd(int fd, void *buffer, size_t size, off_t offset) {
+	auto iter = descriptors.find(fd);
+	if (iter == descriptors.end())
+		return -EBADF;
+	return iter->second.driver->readFd(iter->second.fd, buffer, size, offset);
+}
+
+int Kernel::writeFd(int fd, const char *buffer, size_t size, off_t offset) {
+	auto iter = descriptors.find(fd);
+	if (iter == descriptors.end())
+		return -EBADF;
+	return iter->second.driver->writeFd(iter->second.fd, buffer, size, offset);
+}
+
+int Kernel::getsizeFd(int fd, size_t &out) {
+	auto iter = descriptors.find(fd);
+	if (iter == descriptors.end())
+		return -EBADF;
+	return iter->second.driver->getsizeFd(iter->second.fd, out);
 }
 
 int Kernel::read(const char *path, void *buffer, size_t size, off_t offset) {
@@ -0,0 +1,57 @@
+#include "Kernel.h"
+#include "Module.h"
+
+Module::~Module() {
+	delete[] memory;
+}
+
+bool Module::addCommand(const std::string &command_name, const Thurisaz::Command &command) {
+	if (!kernel.commands.try_emplace(command_name, command).second)
+		return false;
+	commands.push_back(command_name);
+	return true;
+}
+
+bool Module::addDriverType(const std::string &type, const FS::DriverFactory &factory) {
+	if (!kernel.driverTypes.try_emplace(type, Kernel::DriverType {factory, this}).second)
+		return false;
+	driverTypes.push_back(type);
+	return true;
+}
+
+bool Module::addDevice(const std::string &device_name, std::shared_ptr<StorageDevice> device) {
+	if (!kernel.devices.try_emplace(device_name, device).second)
+		return false;
+	devices.push_back(device_name);
+	return true;
+}
+
+bool Module::busy() const {
+	for (const auto &driver: drivers)
+		if (!driver.expired())
+			return true;
+
+	// The kernel's map holds one reference; any other means a partition or driver is still using the device.
+	for (const std::string &device_name: devices) {
+		auto iter = kernel.devices.find(device_name);
+		if (iter != kernel.devices.end() && 1 < iter->second.use_count())
+			return true;
+	}
+
+	return false;
+}
+
+void Module::unregister() {
+	// The std::function objects and devices being destroyed here may have code inside the module, so this has to
+	// happen before the module's memory is freed.
+	for (const std::string &command_name: commands)
+		kernel.commands.erase(command_name);
+	for (const std::string &type: driverTypes)
+		kernel.driverTypes.erase(type);
+	for (const std::string &device_name: devices)
+		kernel.devices.erase(device_name);
+	commands.clear();
+	driverTypes.clear();
+	devices.clear();
+	drivers.clear();
+}
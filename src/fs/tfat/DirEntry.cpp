@@ -15,6 +15,7 @@ namespace ThornFAT {
 		modes = other.modes;
 		uid = other.uid;
 		gid = other.gid;
+		memcpy(padding, other.padding, sizeof(padding));
 	}
 
 	DirEntry & DirEntry::operator=(const DirEntry &other) {
@@ -26,6 +27,7 @@ namespace ThornFAT {
 		modes = other.modes;
 		uid = other.uid;
 		gid = other.gid;
+		memcpy(padding, other.padding, sizeof(padding));
 		return *this;
 	}
 
@@ -38,6 +40,56 @@ namespace ThornFAT {
 		modes = 0;
 		uid = 0;
 		gid = 0;
+		memset(padding, 0, sizeof(padding));
+	}
+
+	char * DirEntry::inlineData() {
+		return name.str + sizeof(name.str) - inlineSpace();
+	}
+
+	const char * DirEntry::inlineData() const {
+		return name.str + sizeof(name.str) - inlineSpace();
+	}
+
+	size_t DirEntry::inlineSpace() const {
+		// Keeping the data word-aligned leaves the rest of the name's last word zeroed for nameMatches.
+		const size_t start = updiv(strnlen(name.str, sizeof(name.str) - 1) + 1, sizeof(uint64_t)) * sizeof(uint64_t);
+		return sizeof(name.str) - start;
+	}
+
+	uint64_t DirEntry::hashName(const char *str) {
+		// 64-bit FNV-1a. 0 is reserved for entries without a stored hash.
+		uint64_t hash = 0xcbf29ce484222325;
+		for (; *str; ++str) {
+			hash ^= uint8_t(*str);
+			hash *= 0x100000001b3;
+		}
+		return hash == 0? 1 : hash;
+	}
+
+	uint64_t DirEntry::nameHash() const {
+		uint64_t hash;
+		memcpy(&hash, padding, sizeof(hash));
+		return hash;
+	}
+
+	void DirEntry::updateHash() {
+		const uint64_t hash = name.str[0] == '\0'? 0 : hashName(name.str);
+		memcpy(padding, &hash, sizeof(hash));
+	}
+
+	bool DirEntry::nameMatches(const Filename &search, uint64_t search_hash) const {
+		const uint64_t hash = nameHash();
+		if (hash != 0 && hash != search_hash)
+			return false;
+		for (size_t i = 0; i < sizeof(name.longs) / sizeof(name.longs[0]); ++i) {
+			if (name.longs[i] != search.longs[i])
+				return false;
+			// Whatever follows the word holding the terminator is inline data, not part of the name.
+			if (memchr(&search.longs[i], '\0', sizeof(search.longs[i])))
+				break;
+		}
+		return true;
 	}
 
 	DirEntry::operator std::string() const {
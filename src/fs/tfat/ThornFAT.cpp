@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <cerrno>
+#include <iterator>
 #include <string>
 #include <string.h>
 
@@ -24,6 +26,11 @@ namespace ThornFAT {
 	ThornFATDriver::ThornFATDriver(std::shared_ptr<Partition> partition_): Driver(partition_) {
 		root.startBlock = UNUSABLE;
 		readSuperblock(superblock);
+		compactEntries = superblock.magic == MAGIC_V2;
+	}
+
+	ThornFATDriver::~ThornFATDriver() {
+		flushFAT();
 	}
 
 	int ThornFATDriver::readSuperblock(Superblock &out) {
@@ -59,11 +66,8 @@ namespace ThornFAT {
 			return 0;
 		}
 
-		size_t count, i;
 		bool at_end;
 
-		std::vector<DirEntry> entries;
-		std::vector<off_t> offsets;
 		std::string newpath, remaining = path;
 
 		// Start at the root.
@@ -97,72 +101,99 @@ namespace ThornFAT {
 				return -ENOENT;
 			}
 
-			int status = readDir(dir, entries, &offsets);
-			count = entries.size();
-			if (status < 0) {
-				WARN(FATFINDH, "Couldn't read directory. Status: " BDR, status);
-				FF_EXIT;
-				return status;
-			}
-
-			// If we find any matches in the following for loop, this is set to 1.
-			// If it stays 0, there were no (non-free) matches in the directory and the search failed.
-			int found = 0;
+			// Consult the dentry cache before touching the disk. Negative entries let repeated misses skip the
+			// directory scan too.
+			DirEntry entry;
+			off_t entry_offset = 0;
+			bool matched = false;
+			// "." and ".." are never indexed, so they always come from a scan.
+			const bool indexable = *search != "." && *search != "..";
+			const std::string key = dentryKey(dir_offset, *search);
+			auto cached = dcache.find(key);
+			if (cached != dcache.end()) {
+				if (cached->second.negative) {
+					DBG(FATFINDH, "Returning nothing (cached).");
+					FF_EXIT;
+					return -ENOENT;
+				}
 
-			for (i = 0; i < count; ++i) {
-				DirEntry &entry = entries[i];
-				char *fname = entry.name.str;
-				if (search == fname && !isFree(entry)) {
-					if (entry.isFile()) {
-						if (at_end) {
-							// We're at the end of the path and it's a file!
-							DBG(FATFINDH, "Returning file at the end.");
-							DBGF(FATFINDH, "  Name" DL " " BSTR DM " offset" DL " " BLR, entry.name.str, offsets[i]);
-
-							if (out)
-								*out = entry;
-							if (offset)
-								*offset = offsets[i];
-
-							FF_EXIT;
-							return 0;
-						}
-
-						// At this point, we've found a file, but we're still trying to search it like a directory.
-						// That's not valid because it's a directory, so an ENOTDIR error occurs.
-						WARN(FATFINDH, "Not a directory: " BSR, fname);
-						FF_EXIT;
-						return -ENOTDIR;
-					} else if (at_end) {
-						// This is a directory at the end of the path. Success.
-						DBG(FATFINDH, "Returning directory at the end.");
-						DBG2(FATFINDH, "  Name:", entry.name.str);
-
-						if (out)
-							*out = entry;
-						if (offset)
-							*offset = offsets[i];
-
-						FF_EXIT;
-						return 0;
+				entry = cached->second.entry;
+				entry_offset = cached->second.offset;
+				matched = true;
+			} else if (int indexed = indexable? indexLookup(dir.startBlock, *search, entry, entry_offset) : -1;
+			           0 <= indexed) {
+				matched = indexed == 1;
+				cacheDentry(key, matched? &entry : nullptr, entry_offset);
+			} else {
+				Filename search_name;
+				strncpy(search_name.str, search->c_str(), THORNFAT_PATH_MAX);
+				const uint64_t search_hash = DirEntry::hashName(search_name.str);
+				int status = iterateDir(dir, [&](const DirEntry &candidate, off_t candidate_offset) {
+					if (candidate.nameMatches(search_name, search_hash) && !isFree(candidate)) {
+						entry = candidate;
+						entry_offset = candidate_offset;
+						matched = true;
+						return false;
 					}
+					return true;
+				}, &search_name, search_hash);
 
-					// This is a directory, but we're not at the end yet. Search within this directory next.
-					dir = entry;
-					dir_offset = offsets[i];
-					found = 1;
-					break;
+				if (status < 0) {
+					WARN(FATFINDH, "Couldn't read directory. Status: " BDR, status);
+					FF_EXIT;
+					return status;
 				}
-			}
 
-			done = remaining.empty();
+				cacheDentry(key, matched? &entry : nullptr, entry_offset);
+			}
 
-			if (!found) {
+			if (!matched) {
 				// None of the (non-free) entries in the directory matched.
 				DBG(FATFINDH, "Returning nothing.");
 				FF_EXIT;
 				return -ENOENT;
 			}
+
+			char *fname = entry.name.str;
+			if (entry.isFile()) {
+				if (at_end) {
+					// We're at the end of the path and it's a file!
+					DBG(FATFINDH, "Returning file at the end.");
+					DBGF(FATFINDH, "  Name" DL " " BSTR DM " offset" DL " " BLR, entry.name.str, entry_offset);
+
+					if (out)
+						*out = entry;
+					if (offset)
+						*offset = entry_offset;
+
+					FF_EXIT;
+					return 0;
+				}
+
+				// At this point, we've found a file, but we're still trying to search it like a directory.
+				// That's not valid because it's a directory, so an ENOTDIR error occurs.
+				WARN(FATFINDH, "Not a directory: " BSR, fname);
+				FF_EXIT;
+				return -ENOTDIR;
+			} else if (at_end) {
+				// This is a directory at the end of the path. Success.
+				DBG(FATFINDH, "Returning directory at the end.");
+				DBG2(FATFINDH, "  Name:", entry.name.str);
+
+				if (out)
+					*out = entry;
+				if (offset)
+					*offset = entry_offset;
+
+				FF_EXIT;
+				return 0;
+			}
+
+			// This is a directory, but we're not at the end yet. Search within this directory next.
+			dir = entry;
+			dir_offset = entry_offset;
+
+			done = remaining.empty();
 		} while (!done);
 		// It shouldn't be possible to get here.
 		WARNS(FATFINDH, "Reached the end of the function " UDARR " " IDS("EIO"));
@@ -170,16 +201,698 @@ namespace ThornFAT {
 		return -EIO;
 	}
 
+	std::string ThornFATDriver::dentryKey(off_t parent_offset, const std::string &name) {
+		return std::to_string(parent_offset) + "/" + name;
+	}
+
+	void ThornFATDriver::cacheDentry(const std::string &key, const DirEntry *entry, off_t offset) {
+		if (DCACHE_MAX <= dcache.size())
+			clearDentries();
+
+		if (entry) {
+			dcache.insert_or_assign(key, Dentry {*entry, offset, false});
+			dcacheOffsets.insert_or_assign(offset, key);
+		} else
+			dcache.insert_or_assign(key, Dentry {{}, 0, true});
+	}
+
+	void ThornFATDriver::forgetDentry(const std::string &key) {
+		auto iter = dcache.find(key);
+		if (iter == dcache.end())
+			return;
+		if (!iter->second.negative)
+			dcacheOffsets.erase(iter->second.offset);
+		dcache.erase(iter);
+	}
+
+	void ThornFATDriver::updateDentry(const DirEntry &entry, off_t offset) {
+		auto iter = dcacheOffsets.find(offset);
+		if (iter == dcacheOffsets.end())
+			return;
+
+		auto cached = dcache.find(iter->second);
+		if (cached == dcache.end() || entry.startBlock == 0 || strcmp(cached->second.entry.name.str, entry.name.str)) {
+			// The entry was freed or renamed, so the cached name no longer refers to it.
+			if (cached != dcache.end())
+				dcache.erase(cached);
+			dcacheOffsets.erase(iter);
+		} else
+			cached->second.entry = entry;
+	}
+
+	void ThornFATDriver::clearDentries() {
+		dcache.clear();
+		dcacheOffsets.clear();
+	}
+
+	ThornFATDriver::DirInfo * ThornFATDriver::dirInfo(const DirEntry &dir) {
+		auto iter = dirInfos.find(dir.startBlock);
+		if (iter != dirInfos.end()) {
+			if (iter->second.length == dir.length) {
+				iter->second.lastUsed = ++dirInfoClock;
+				return &iter->second;
+			}
+			dirInfos.erase(iter);
+		}
+
+		if (DIRINFO_MAX <= dirInfos.size())
+			dirInfos.erase(std::min_element(dirInfos.begin(), dirInfos.end(), [](const auto &a, const auto &b) {
+				return a.second.lastUsed < b.second.lastUsed;
+			}));
+
+		DirInfo info;
+		info.length = dir.length;
+		info.lastUsed = ++dirInfoClock;
+		off_t last_offset = -1;
+		const int status = iterateDir(dir, [&](const DirEntry &entry, off_t entry_offset) {
+			last_offset = entry_offset;
+			if (strcmp(entry.name.str, ".") != 0 && strcmp(entry.name.str, "..") != 0 && isFree(entry))
+				info.freeSlots.insert(entry_offset);
+			return true;
+		});
+
+		if (status < 0 || last_offset < 0)
+			return nullptr;
+
+		// Entries never straddle blocks, so the last entry's block is the tail of the chain.
+		info.tailBlock = last_offset / superblock.blockSize;
+		return &dirInfos.insert_or_assign(dir.startBlock, std::move(info)).first->second;
+	}
+
+	void ThornFATDriver::releaseSlot(const char *path, off_t offset) {
+		DirEntry parent;
+		std::string name;
+		if (find(-1, path, &parent, nullptr, true, &name) < 0)
+			return;
+
+		indexRemove(parent.startBlock, name.c_str(), offset);
+
+		auto iter = dirInfos.find(parent.startBlock);
+		if (iter != dirInfos.end() && iter->second.length == parent.length)
+			iter->second.freeSlots.insert(offset);
+	}
+
+	void ThornFATDriver::claimSlot(off_t offset) {
+		for (auto &[start, info]: dirInfos)
+			info.freeSlots.erase(offset);
+	}
+
+	int ThornFATDriver::compactDir(DirEntry &dir, off_t dir_offset) {
+		std::vector<DirEntry> entries;
+		std::vector<off_t> offsets;
+		int status = readDir(dir, entries, &offsets);
+		if (status < 0)
+			return status;
+
+		// The nth live entry goes to the nth slot. Entries only ever move toward the front, so nothing is
+		// overwritten before it has been copied.
+		std::unordered_map<off_t, off_t> moved;
+		std::vector<size_t> moved_indices;
+		size_t live = 0;
+		for (size_t i = 0; i < entries.size(); ++i) {
+			if (isFree(entries[i]))
+				continue;
+
+			const off_t new_offset = offsets[live++];
+			if (new_offset == offsets[i])
+				continue;
+
+			if ((status = storeEntry(entries[i], new_offset)) < 0)
+				return status;
+
+			moved[offsets[i]] = new_offset;
+			moved_indices.push_back(i);
+		}
+
+		if (live == entries.size()) {
+#ifdef SHRINK_DIRS
+			// Nothing moves, but the chain may still be longer than the directory needs.
+			trimDir(dir);
+#endif
+			return 0;
+		}
+
+		// Slots past the new end keep stale copies, but their long names have to go.
+		for (size_t i = live; i < entries.size(); ++i)
+			forgetName(offsets[i]);
+
+		dir.length = live * entrySize();
+		status = writeEntry(dir, dir_offset);
+		SCHECK("compactDir", "Couldn't write the directory's entry");
+		trimDir(dir);
+
+		for (auto &[fd, open_file]: openFiles) {
+			auto iter = moved.find(open_file.offset);
+			if (iter != moved.end())
+				open_file.offset = iter->second;
+		}
+
+		// Dentry keys contain the offsets of parent directories' entries, so any of them could be stale now.
+		clearDentries();
+		dirInfos.erase(dir.startBlock);
+
+		// The directory is consistent again, so a rebuild triggered by an insert sees the right entries.
+		for (size_t i: moved_indices)
+			indexRemove(dir.startBlock, entries[i].name.str, offsets[i]);
+		for (size_t i: moved_indices)
+			indexInsert(dir.startBlock, entries[i].name.str, moved.at(offsets[i]));
+
+		DBGF("compactDir", "Compacted " BSTR " from " BULR " to " BULR " entries", dir.name.str, entries.size(), live);
+		return 0;
+	}
+
+	void ThornFATDriver::trimDir(const DirEntry &dir) {
+		const std::vector<block_t> blocks = blockMap(dir.startBlock);
+		const size_t needed = std::max<size_t>(1, updiv(size_t(dir.length), size_t(superblock.blockSize)));
+		if (blocks.size() <= needed)
+			return;
+
+		const unsigned long long extra = blocks.size() - needed;
+		DBGF("trimDir", "Freeing " BULR " extra block%s after block " BULR, PLURALS(extra),
+			(unsigned long long) blocks[needed - 1]);
+		for (size_t i = needed; i < blocks.size(); ++i)
+			writeFAT(0, blocks[i]);
+		writeFAT(FINAL, blocks[needed - 1]);
+		forgetBlockMap(dir.startBlock);
+		dirInfos.erase(dir.startBlock);
+	}
+
+	void ThornFATDriver::maybeCompact(const char *path) {
+		if (!autoCompact)
+			return;
+
+		DirEntry parent;
+		off_t parent_offset;
+		if (find(-1, path, &parent, &parent_offset, true) < 0 || parent.length <= superblock.blockSize)
+			return;
+
+		// Only directories whose dead entries are already known are considered; this isn't worth a scan.
+		auto iter = dirInfos.find(parent.startBlock);
+		if (iter == dirInfos.end() || iter->second.length != parent.length)
+			return;
+
+		const size_t slots = parent.length / entrySize();
+		if (COMPACT_DEAD_PERCENT * slots <= 100 * iter->second.freeSlots.size()) {
+			const int status = compactDir(parent, parent_offset);
+			if (status < 0)
+				WARN("maybeCompact", "Compacting " BSTR " failed: " BDR, parent.name.str, status);
+		}
+	}
+
+	int ThornFATDriver::compact(const char *path) {
+		DirEntry found;
+		off_t offset;
+		int status = find(-1, path, &found, &offset);
+		SCHECK("compact", "find failed");
+
+		if (!found.isDirectory())
+			return -ENOTDIR;
+
+		return compactDir(found, offset);
+	}
+
+	void ThornFATDriver::addFragStats(FS::FragStats &stats, block_t start) {
+		// Holes don't take up space, so they don't split extents either.
+		const std::vector<block_t> &map = blockMap(start);
+		std::vector<block_t> blocks;
+		std::copy_if(map.begin(), map.end(), std::back_inserter(blocks), [](block_t block) { return block != HOLE; });
+		if (blocks.empty())
+			return;
+
+		size_t extents = 1;
+		for (size_t i = 1; i < blocks.size(); ++i)
+			if (blocks[i] != blocks[i - 1] + 1)
+				++extents;
+
+		++stats.files;
+		stats.extents += extents;
+		stats.blocks += blocks.size();
+		if (extents == 1)
+			++stats.contiguous;
+	}
+
+	int ThornFATDriver::fragmentation(FS::FragStats &stats) {
+		stats = {};
+		std::function<int(const DirEntry &)> visit = [&](const DirEntry &dir) -> int {
+			std::vector<DirEntry> entries;
+			int status = readDir(dir, entries);
+			if (status < 0)
+				return status;
+
+			for (const DirEntry &entry: entries) {
+				if (isFree(entry) || entry.startBlock <= 0 || strcmp(entry.name.str, ".") == 0 ||
+				    strcmp(entry.name.str, "..") == 0)
+					continue;
+				addFragStats(stats, entry.startBlock);
+				if (entry.isDirectory() && 0 < entry.length && (status = visit(entry)) < 0)
+					return status;
+			}
+
+			return 0;
+		};
+
+		const DirEntry &root_entry = getRoot();
+		addFragStats(stats, root_entry.startBlock);
+		return visit(root_entry);
+	}
+
+	int ThornFATDriver::relocateChain(DirEntry &entry, off_t offset) {
+		const block_t old_start = entry.startBlock;
+		const std::vector<block_t> old_map = blockMap(old_start);
+		std::vector<block_t> old_blocks;
+		std::copy_if(old_map.begin(), old_map.end(), std::back_inserter(old_blocks),
+			[](block_t block) { return block != HOLE; });
+		const size_t count = old_blocks.size();
+		if (count <= 1 || old_blocks.back() - old_blocks.front() + 1 == block_t(count))
+			return 0;
+
+		std::vector<block_t> fresh;
+		if (allocateBlocks(count, old_blocks.front(), fresh) != 0)
+			return 0;
+
+		if (fresh.back() - fresh.front() + 1 != block_t(count)) {
+			// No run is big enough; moving the chain wouldn't help.
+			for (const block_t block: fresh)
+				writeFAT(0, block);
+			return 0;
+		}
+
+		// Copy one run of physically consecutive old blocks at a time. Holes have nothing to copy.
+		const size_t bs = superblock.blockSize;
+		constexpr size_t BATCH = 64;
+		std::vector<char> buffer(BATCH * bs);
+		for (size_t i = 0; i < count;) {
+			size_t run = 1;
+			while (i + run < count && run < BATCH && old_blocks[i + run] == old_blocks[i] + block_t(run))
+				++run;
+			ssize_t status = partition->read(buffer.data(), run * bs, size_t(old_blocks[i]) * bs);
+			if (0 <= status)
+				status = partition->write(buffer.data(), run * bs, size_t(fresh[i]) * bs);
+			if (status < 0) {
+				for (const block_t block: fresh)
+					writeFAT(0, block);
+				return status;
+			}
+			i += run;
+		}
+
+		std::vector<block_t> new_map = old_map;
+		for (size_t i = 0, j = 0; i < new_map.size(); ++i)
+			if (new_map[i] != HOLE)
+				new_map[i] = fresh[j++];
+
+		// Make sure the new chain is on disk before the entry points to it, and only free the old blocks afterward.
+		DirEntry moved = entry;
+		int status = encodeChain(moved, std::move(new_map));
+		if (status < 0) {
+			for (const block_t block: fresh)
+				writeFAT(0, block);
+			return status;
+		}
+
+		status = flushFAT();
+		if (status < 0)
+			return status;
+
+		entry.startBlock = moved.startBlock;
+		status = writeEntry(entry, offset);
+		SCHECK("relocateChain", "Couldn't update the entry");
+
+		for (const block_t block: old_blocks)
+			writeFAT(0, block);
+		forgetBlockMap(old_start);
+
+		if (entry.isDirectory()) {
+			dirInfos.erase(old_start);
+			remapOffsets(old_blocks, fresh);
+		}
+
+		return 0;
+	}
+
+	void ThornFATDriver::remapOffsets(const std::vector<block_t> &from, const std::vector<block_t> &to) {
+		const size_t bs = superblock.blockSize;
+		std::unordered_map<block_t, block_t> blocks;
+		for (size_t i = 0; i < from.size() && i < to.size(); ++i)
+			blocks[from[i]] = to[i];
+
+		auto remap = [&](off_t offset) -> off_t {
+			auto iter = blocks.find(offset / bs);
+			return iter == blocks.end()? offset : iter->second * bs + offset % bs;
+		};
+
+		for (auto &[fd, open_file]: openFiles)
+			open_file.offset = remap(open_file.offset);
+
+		std::unordered_map<off_t, NameSlot> names;
+		for (const auto &[offset, slot]: nameSlots)
+			names[remap(offset)] = slot;
+		nameSlots = std::move(names);
+
+		clearDentries();
+	}
+
+	int ThornFATDriver::defragDir(const DirEntry &dir, block_t parent_start) {
+		std::vector<DirEntry> entries;
+		std::vector<off_t> offsets;
+		int status = readDir(dir, entries, &offsets);
+		if (status < 0)
+			return status;
+
+		for (size_t i = 0; i < entries.size(); ++i) {
+			DirEntry &entry = entries[i];
+			if (strcmp(entry.name.str, "..") == 0) {
+				// The parent may have moved.
+				if (entry.startBlock != parent_start && 0 < parent_start) {
+					entry.startBlock = parent_start;
+					if ((status = writeEntry(entry, offsets[i])) < 0)
+						return status;
+				}
+				continue;
+			}
+
+			if (isFree(entry) || entry.startBlock <= 0 || strcmp(entry.name.str, ".") == 0)
+				continue;
+
+			if ((status = relocateChain(entry, offsets[i])) < 0)
+				return status;
+
+			if (entry.isDirectory() && 0 < entry.length && (status = defragDir(entry, dir.startBlock)) < 0)
+				return status;
+		}
+
+		return 0;
+	}
+
+	int ThornFATDriver::defrag(FS::FragStats *before, FS::FragStats *after) {
+		int status = sync();
+		if (status < 0)
+			return status;
+
+		if (before && (status = fragmentation(*before)) < 0)
+			return status;
+
+		// The root's start block is fixed by the superblock, so only what's beneath it moves.
+		const DirEntry root_entry = getRoot(nullptr, true);
+		status = defragDir(root_entry, root_entry.startBlock);
+		clearDentries();
+		dirInfos.clear();
+		if (status < 0)
+			return status;
+
+		// The index refers to directories by start block and entries by offset, both of which may have changed.
+		indexChecked = false;
+		if (loadIndex() && (status = rebuildIndex()) < 0)
+			return status;
+
+		if ((status = flushFAT()) < 0)
+			return status;
+
+		if (after && (status = fragmentation(*after)) < 0)
+			return status;
+
+		return 0;
+	}
+
+	uint32_t ThornFATDriver::indexHash(const char *name) {
+		return uint32_t(DirEntry::hashName(name));
+	}
+
+	bool ThornFATDriver::isHidden(const DirEntry &entry) {
+		return strchr(entry.name.str, '/') != nullptr;
+	}
+
+	bool ThornFATDriver::loadIndex() {
+		if (indexChecked)
+			return 0 <= indexOffset;
+
+		indexChecked = true;
+		indexOffset = -1;
+
+		off_t root_offset;
+		const DirEntry &root_entry = getRoot(&root_offset);
+		if (root_entry.length < 3 * entrySize())
+			return false;
+
+		off_t offset = root_offset + 2 * entrySize();
+		if (superblock.blockSize < 3 * entrySize()) {
+			// The index's entry is the first one in the root's second block.
+			const std::vector<block_t> &map = blockMap(root_entry.startBlock);
+			if (map.size() < 2)
+				return false;
+			offset = off_t(map[1]) * superblock.blockSize;
+		}
+
+		if (loadEntry(indexEntry, offset) < 0)
+			return false;
+
+		if (strcmp(indexEntry.name.str, INDEX_NAME) != 0 || indexEntry.startBlock <= 0 ||
+		    indexEntry.length < 2 * sizeof(IndexBucket))
+			return false;
+
+		if (transfer(indexEntry.startBlock, 0, &indexHeader, sizeof(IndexHeader), false) < 0 ||
+		    indexHeader.magic != INDEX_MAGIC) {
+			WARNS("loadIndex", "Directory index is damaged; falling back to linear scans.");
+			return false;
+		}
+
+		indexOffset = offset;
+		indexHeaderDirty = false;
+		return true;
+	}
+
+	bool ThornFATDriver::createIndex() {
+		off_t root_offset;
+		DirEntry &root_entry = getRoot(&root_offset, true);
+		if (root_entry.length != 2 * entrySize())
+			return false;
+
+		off_t offset = root_offset + 2 * entrySize();
+		if (superblock.blockSize < 3 * entrySize()) {
+			// The root's first block has room only for "." and "..", so the index's entry starts a second one.
+			const block_t next = findFreeBlock();
+			if (next == UNUSABLE)
+				return false;
+			writeFAT(next, root_entry.startBlock);
+			writeFAT(FINAL, next);
+			forgetBlockMap(root_entry.startBlock);
+			offset = off_t(next) * superblock.blockSize;
+		}
+
+		const block_t start = findFreeBlock();
+		if (start == UNUSABLE)
+			return false;
+		writeFAT(FINAL, start);
+
+		DirEntry entry(Times(0, 0, 0), 0, FileType::File);
+		updateName(entry, INDEX_NAME);
+		entry.startBlock = start;
+		if (writeEntry(entry, offset) != 0)
+			return false;
+
+		root_entry.length += entrySize();
+		if (writeEntry(root_entry, root_offset) != 0)
+			return false;
+
+		indexChecked = true;
+		indexOffset = offset;
+		indexEntry = entry;
+		indexHeader = {INDEX_MAGIC, 0, 0};
+		return rebuildIndex() == 0;
+	}
+
+	int ThornFATDriver::rebuildIndex() {
+		if (!loadIndex())
+			return -ENOENT;
+
+		std::vector<IndexBucket> found;
+		std::function<int(const DirEntry &)> collect = [&](const DirEntry &dir) -> int {
+			std::vector<DirEntry> subdirs;
+			int status = iterateDir(dir, [&](const DirEntry &entry, off_t offset) {
+				if (isFree(entry) || isHidden(entry) || strcmp(entry.name.str, ".") == 0 ||
+				    strcmp(entry.name.str, "..") == 0)
+					return true;
+				found.push_back({dir.startBlock, indexHash(entry.name.str), offset});
+				if (entry.isDirectory() && entrySize() <= entry.length)
+					subdirs.push_back(entry);
+				return true;
+			});
+
+			if (status < 0)
+				return status;
+
+			for (const DirEntry &subdir: subdirs)
+				if ((status = collect(subdir)) < 0)
+					return status;
+
+			return 0;
+		};
+
+		int status = collect(getRoot());
+		if (status < 0)
+			return status;
+
+		// Keep the table at most a quarter full so probe sequences stay short and there's room to grow.
+		size_t slots = INDEX_MIN_SLOTS;
+		while (slots < 4 * found.size() + 1)
+			slots *= 2;
+
+		// Growing is left to writeData below so the new blocks aren't zeroed just to be overwritten.
+		const size_t table_size = slots * sizeof(IndexBucket);
+		if (table_size < indexEntry.length) {
+			status = resize(indexEntry, indexOffset, table_size);
+			SCHECK("rebuildIndex", "Couldn't resize the index");
+		}
+
+		std::vector<IndexBucket> table(slots, IndexBucket {0, 0, 0});
+		for (const IndexBucket &bucket: found) {
+			size_t slot = indexProbeStart(bucket.parent, bucket.nameHash);
+			while (table[slot].parent != 0)
+				slot = slot + 1 < slots? slot + 1 : 1;
+			table[slot] = bucket;
+		}
+
+		indexHeader = {INDEX_MAGIC, uint32_t(found.size()), found.size()};
+		memcpy(&table[0], &indexHeader, sizeof(IndexHeader));
+		const ssize_t written = writeData(indexEntry, indexOffset, reinterpret_cast<const char *>(table.data()),
+			table_size, 0);
+		if (written < 0)
+			return written;
+
+		indexHeaderDirty = false;
+		return 0;
+	}
+
+	size_t ThornFATDriver::indexSlots() const {
+		return indexEntry.length / sizeof(IndexBucket);
+	}
+
+	size_t ThornFATDriver::indexProbeStart(block_t parent, uint32_t hash) const {
+		// Slot 0 holds the header.
+		return 1 + (hash ^ (uint32_t(parent) * 0x9e3779b9u)) % (indexSlots() - 1);
+	}
+
+	int ThornFATDriver::readBucket(size_t slot, IndexBucket &bucket) {
+		const ssize_t status = transfer(indexEntry.startBlock, slot * sizeof(IndexBucket), &bucket,
+			sizeof(IndexBucket), false);
+		return status < 0? status : 0;
+	}
+
+	int ThornFATDriver::writeBucket(size_t slot, const IndexBucket &bucket) {
+		const ssize_t status = transfer(indexEntry.startBlock, slot * sizeof(IndexBucket),
+			const_cast<IndexBucket *>(&bucket), sizeof(IndexBucket), true);
+		return status < 0? status : 0;
+	}
+
+	int ThornFATDriver::indexLookup(block_t parent, const std::string &name, DirEntry &out, off_t &out_offset) {
+		if (!loadIndex())
+			return -1;
+
+		Filename search_name;
+		strncpy(search_name.str, name.c_str(), THORNFAT_PATH_MAX);
+		const uint64_t search_hash = DirEntry::hashName(search_name.str);
+		const uint32_t hash = uint32_t(search_hash);
+		const size_t slots = indexSlots();
+		size_t slot = indexProbeStart(parent, hash);
+		for (size_t n = 1; n < slots; ++n, slot = slot + 1 < slots? slot + 1 : 1) {
+			IndexBucket bucket;
+			if (readBucket(slot, bucket) < 0)
+				return -1;
+
+			if (bucket.parent == 0)
+				return 0;
+
+			if (bucket.parent != parent || bucket.nameHash != hash)
+				continue;
+
+			DirEntry candidate;
+			if (loadEntry(candidate, bucket.offset, &search_name, search_hash) < 0)
+				return -1;
+
+			if (candidate.nameMatches(search_name, search_hash) && !isFree(candidate)) {
+				out = candidate;
+				out_offset = bucket.offset;
+				return 1;
+			}
+		}
+
+		return 0;
+	}
+
+	void ThornFATDriver::indexInsert(block_t parent, const char *name, off_t offset) {
+		if (!loadIndex())
+			return;
+
+		if (indexSlots() <= 2 * (indexHeader.used + 1)) {
+			// The entry is already on disk, so the rebuild picks it up.
+			if (rebuildIndex() < 0)
+				WARNS("indexInsert", "Couldn't rebuild the directory index.");
+			return;
+		}
+
+		const uint32_t hash = indexHash(name);
+		const size_t slots = indexSlots();
+		size_t slot = indexProbeStart(parent, hash);
+		for (size_t n = 1; n < slots; ++n, slot = slot + 1 < slots? slot + 1 : 1) {
+			IndexBucket bucket;
+			if (readBucket(slot, bucket) < 0)
+				break;
+
+			if (bucket.parent == 0 || bucket.parent == UNUSABLE) {
+				if (bucket.parent == 0)
+					++indexHeader.used;
+				++indexHeader.live;
+				indexHeaderDirty = true;
+				if (writeBucket(slot, {parent, hash, offset}) == 0)
+					return;
+				break;
+			}
+		}
+
+		// An index missing an entry would hide a file, so start over from the tree.
+		WARNS("indexInsert", "Couldn't add to the directory index; rebuilding it.");
+		rebuildIndex();
+	}
+
+	void ThornFATDriver::indexRemove(block_t parent, const char *name, off_t offset) {
+		if (!loadIndex())
+			return;
+
+		const uint32_t hash = indexHash(name);
+		const size_t slots = indexSlots();
+		size_t slot = indexProbeStart(parent, hash);
+		for (size_t n = 1; n < slots; ++n, slot = slot + 1 < slots? slot + 1 : 1) {
+			IndexBucket bucket;
+			if (readBucket(slot, bucket) < 0 || bucket.parent == 0)
+				return;
+
+			if (bucket.parent == parent && bucket.nameHash == hash && bucket.offset == offset) {
+				bucket.parent = UNUSABLE;
+				if (writeBucket(slot, bucket) == 0) {
+					--indexHeader.live;
+					indexHeaderDirty = true;
+				}
+				return;
+			}
+		}
+	}
+
 	size_t ThornFATDriver::forget(block_t start) {
+		if (start <= 0)
+			return 0;
+
 		ENTER;
 
 		DBGNE(FORGETH, "Forgetting", start);
+		forgetBlockMap(start);
+		dirInfos.erase(start);
 
 		int64_t next;
 		block_t block = start;
 		size_t removed = 0;
 		for (;;) {
 			next = readFAT(block);
+			holeCounts.erase(block);
 			if (next == FINAL) {
 				DBGFE(FORGETH, "Freeing " BLR " (next == FINAL)", block);
 				writeFAT(0, block);
@@ -194,7 +907,6 @@ namespace ThornFAT {
 				break;
 		}
 
-		blocksFree += removed;
 		EXIT;
 		return removed;
 	}
@@ -228,34 +940,402 @@ namespace ThornFAT {
 		return length;
 	}
 
+	std::vector<block_t> & ThornFATDriver::blockMap(block_t start) {
+		auto iter = blockMaps.find(start);
+		if (iter != blockMaps.end()) {
+			iter->second.lastUsed = ++blockMapClock;
+			return iter->second.blocks;
+		}
+
+		std::vector<block_t> &map = blockMapSlot(start);
+		if (0 < start && readFAT(start) != 0)
+			for (block_t block = start; 0 < block;) {
+				const block_t raw = rawFAT(block);
+				if (0 < raw && (raw & HOLE_FLAG)) {
+					map.insert(map.end(), holeCount(block), HOLE);
+					block = raw & ~HOLE_FLAG;
+				} else {
+					map.push_back(block);
+					block = raw;
+				}
+			}
+		return map;
+	}
+
+	std::vector<block_t> & ThornFATDriver::blockMapSlot(block_t start) {
+		auto iter = blockMaps.find(start);
+		if (iter == blockMaps.end()) {
+			if (BLOCKMAP_MAX <= blockMaps.size())
+				blockMaps.erase(std::min_element(blockMaps.begin(), blockMaps.end(), [](const auto &a, const auto &b) {
+					return a.second.lastUsed < b.second.lastUsed;
+				}));
+			iter = blockMaps.try_emplace(start).first;
+		}
+
+		iter->second.lastUsed = ++blockMapClock;
+		return iter->second.blocks;
+	}
+
+	void ThornFATDriver::forgetBlockMap(block_t start) {
+		blockMaps.erase(start);
+	}
+
+	size_t ThornFATDriver::entrySize() const {
+		return compactEntries? sizeof(CompactEntry) : sizeof(DirEntry);
+	}
+
+	size_t ThornFATDriver::inlineCapacity(const DirEntry &entry) const {
+		if (!entry.isFile())
+			return 0;
+
+		if (!compactEntries)
+			return entry.inlineSpace();
+
+		// v2 entries only have whatever the name leaves of their short name field.
+		const size_t name_length = strnlen(entry.name.str, THORNFAT_PATH_MAX);
+		return name_length < COMPACT_NAME_MAX? std::min(COMPACT_NAME_MAX - name_length, entry.inlineSpace()) : 0;
+	}
+
+	int ThornFATDriver::spill(DirEntry &file, const char *data) {
+		const block_t block = findFreeBlock();
+		if (block == UNUSABLE) {
+			WARNS("spill", "No free block " UDARR " " IDS("ENOSPC"));
+			return -ENOSPC;
+		}
+
+		// Inline data is always smaller than a block.
+		if (file.length != 0) {
+			const ssize_t status = partition->write(data, file.length, size_t(block) * superblock.blockSize);
+			SCHECK("spill", "Couldn't write inline data");
+		}
+
+		writeFAT(FINAL, block);
+		memset(file.inlineData(), 0, file.inlineSpace());
+		file.startBlock = block;
+		return 0;
+	}
+
+	int ThornFATDriver::decodeEntry(const void *raw, off_t offset, DirEntry &out, const Filename *search,
+	                                uint64_t search_hash) {
+		if (!compactEntries) {
+			memcpy(&out, raw, sizeof(DirEntry));
+			return 0;
+		}
+
+		CompactEntry compact_entry;
+		memcpy(&compact_entry, raw, sizeof(CompactEntry));
+		out.reset();
+		out.times = compact_entry.times;
+		out.length = compact_entry.length;
+		out.startBlock = compact_entry.startBlock;
+		out.type = FileType(compact_entry.type);
+		out.modes = compact_entry.modes;
+		out.uid = compact_entry.uid;
+		out.gid = compact_entry.gid;
+		memcpy(out.padding, compact_entry.padding, sizeof(out.padding));
+
+		if (compact_entry.nameBlock <= 0) {
+			const size_t name_length = std::min<size_t>(compact_entry.nameLength, COMPACT_NAME_MAX);
+			memcpy(out.name.str, compact_entry.name, name_length);
+			if (out.isInline())
+				memcpy(out.inlineData(), compact_entry.name + name_length,
+					std::min<size_t>(out.length, COMPACT_NAME_MAX - name_length));
+			return 0;
+		}
+
+		const size_t name_length = std::min<size_t>(compact_entry.nameLength, THORNFAT_PATH_MAX);
+		nameSlots[offset] = {compact_entry.nameBlock, compact_entry.nameUnit, uint16_t(updiv(name_length, NAME_UNIT))};
+
+		// Nobody looks at the names of free entries, and a lookup doesn't need the rest of a name that can't match, so
+		// the prefix is enough for those.
+		const uint64_t hash = out.nameHash();
+		if (compact_entry.startBlock == 0 || (search && ((hash != 0 && hash != search_hash) ||
+		    strncmp(compact_entry.name, search->str, COMPACT_NAME_MAX) != 0))) {
+			memcpy(out.name.str, compact_entry.name, COMPACT_NAME_MAX);
+			return 0;
+		}
+
+		const ssize_t status = partition->read(out.name.str, name_length,
+			compact_entry.nameBlock * superblock.blockSize + compact_entry.nameUnit * NAME_UNIT);
+		return status < 0? status : 0;
+	}
+
+	int ThornFATDriver::loadEntry(DirEntry &out, off_t offset, const Filename *search, uint64_t search_hash) {
+		char raw[sizeof(DirEntry)];
+		const ssize_t status = partition->read(raw, entrySize(), offset);
+		if (status < 0)
+			return status;
+		return decodeEntry(raw, offset, out, search, search_hash);
+	}
+
+	int ThornFATDriver::storeEntry(const DirEntry &entry, off_t offset) {
+		if (entry.nameHash() == 0 && entry.name.str[0] != '\0') {
+			// Entries from before names were hashed pick up a hash the next time they're written.
+			DirEntry hashed = entry;
+			hashed.updateHash();
+			return storeEntry(hashed, offset);
+		}
+
+		if (!compactEntries) {
+			const ssize_t status = partition->write(&entry, sizeof(DirEntry), offset);
+			return status < 0? status : 0;
+		}
+
+		CompactEntry compact_entry {};
+		compact_entry.times = entry.times;
+		compact_entry.length = entry.length;
+		compact_entry.startBlock = entry.startBlock;
+		compact_entry.type = uint8_t(entry.type);
+		compact_entry.modes = entry.modes;
+		compact_entry.uid = entry.uid;
+		compact_entry.gid = entry.gid;
+		memcpy(compact_entry.padding, entry.padding, sizeof(compact_entry.padding));
+
+		const size_t name_length = strnlen(entry.name.str, THORNFAT_PATH_MAX);
+		compact_entry.nameLength = name_length;
+		memcpy(compact_entry.name, entry.name.str, std::min(name_length, COMPACT_NAME_MAX));
+		if (entry.isInline() && name_length < COMPACT_NAME_MAX)
+			memcpy(compact_entry.name + name_length, entry.inlineData(),
+				std::min<size_t>(entry.length, COMPACT_NAME_MAX - name_length));
+
+		// A slot keeps its name's units until a name of a different size is written to it or the entry is freed, so
+		// most renames don't have to allocate again. Nobody reads the names of free entries, and a freed slot might
+		// never be reused (its whole directory could be removed), so its units go back right away.
+		auto known = nameSlots.find(offset);
+		if (COMPACT_NAME_MAX < name_length && entry.startBlock != 0) {
+			if (known != nameSlots.end() && known->second.units != updiv(name_length, NAME_UNIT)) {
+				forgetName(offset);
+				known = nameSlots.end();
+			}
+
+			if (known == nameSlots.end()) {
+				NameSlot slot;
+				const int status = allocateName(name_length, slot);
+				if (status < 0)
+					return status;
+				known = nameSlots.emplace(offset, slot).first;
+			}
+
+			const NameSlot &slot = known->second;
+			const ssize_t status = partition->write(entry.name.str, name_length,
+				slot.block * superblock.blockSize + slot.unit * NAME_UNIT);
+			if (status < 0)
+				return status;
+			compact_entry.nameBlock = slot.block;
+			compact_entry.nameUnit = slot.unit;
+		} else if (known != nameSlots.end()) {
+			forgetName(offset);
+		}
+
+		const ssize_t status = partition->write(&compact_entry, sizeof(CompactEntry), offset);
+		return status < 0? status : 0;
+	}
+
+	int ThornFATDriver::clearEntry(off_t offset) {
+		forgetName(offset);
+		const ssize_t status = partition->write(nothing, entrySize(), offset);
+		return status < 0? status : 0;
+	}
+
+	int ThornFATDriver::allocateName(size_t length, NameSlot &out) {
+		const size_t units = updiv(length, NAME_UNIT);
+		const size_t per_block = std::min(NAME_UNITS_MAX, superblock.blockSize / NAME_UNIT);
+		const uint64_t mask = (uint64_t(1) << units) - 1;
+
+		block_t block = UNUSABLE;
+		uint64_t *used = nullptr;
+		size_t unit = 0;
+		for (auto &[candidate, candidate_used]: nameBlockUsage) {
+			// Unit 0 holds the bitmap.
+			for (unit = 1; unit + units <= per_block; ++unit)
+				if ((candidate_used & (mask << unit)) == 0)
+					break;
+			if (unit + units <= per_block) {
+				block = candidate;
+				used = &candidate_used;
+				break;
+			}
+		}
+
+		if (block == UNUSABLE) {
+			block = findFreeBlock();
+			if (block == UNUSABLE)
+				return -ENOSPC;
+			writeFAT(FINAL, block);
+			used = &nameBlockUsage[block];
+			*used = 1;
+			unit = 1;
+		}
+
+		*used |= mask << unit;
+		const ssize_t status = partition->write(used, sizeof(*used), size_t(block) * superblock.blockSize);
+		if (status < 0)
+			return status;
+
+		out = {block, uint16_t(unit), uint16_t(units)};
+		if (*used == (per_block == NAME_UNITS_MAX? ~uint64_t(0) : (uint64_t(1) << per_block) - 1))
+			nameBlockUsage.erase(block);
+		return 0;
+	}
+
+	int ThornFATDriver::releaseName(const NameSlot &slot) {
+		auto iter = nameBlockUsage.find(slot.block);
+		if (iter == nameBlockUsage.end()) {
+			// Full blocks and blocks that haven't been touched yet aren't tracked.
+			uint64_t used = 0;
+			const ssize_t status = partition->read(&used, sizeof(used), size_t(slot.block) * superblock.blockSize);
+			if (status < 0)
+				return status;
+			iter = nameBlockUsage.emplace(slot.block, used).first;
+		}
+
+		uint64_t &used = iter->second;
+		used &= ~(((uint64_t(1) << slot.units) - 1) << slot.unit);
+		if (used <= 1) {
+			// Only the bitmap is left.
+			nameBlockUsage.erase(iter);
+			return writeFAT(0, slot.block);
+		}
+
+		const ssize_t status = partition->write(&used, sizeof(used), size_t(slot.block) * superblock.blockSize);
+		return status < 0? status : 0;
+	}
+
+	void ThornFATDriver::forgetName(off_t offset) {
+		auto known = nameSlots.find(offset);
+		if (known != nameSlots.end()) {
+			releaseName(known->second);
+			nameSlots.erase(known);
+		}
+	}
+
+	int ThornFATDriver::convert() {
+		if (compactEntries)
+			return -EINVAL;
+
+		if (!openFiles.empty())
+			return -EBUSY;
+
+		int status = sync();
+		if (status < 0)
+			return status;
+
+		// Read every directory while the volume is still in the old format. Free entries are dropped along the way.
+		std::map<block_t, std::vector<DirEntry>> dirs;
+		std::function<int(const DirEntry &)> collect = [&](const DirEntry &dir) -> int {
+			if (dirs.count(dir.startBlock) != 0)
+				return 0;
+
+			std::vector<DirEntry> all;
+			int status = readDir(dir, all);
+			if (status < 0)
+				return status;
+
+			std::vector<DirEntry> &live = dirs[dir.startBlock];
+			for (const DirEntry &entry: all)
+				if (!isFree(entry))
+					live.push_back(entry);
+
+			for (const DirEntry &entry: all)
+				if (entry.isDirectory() && !isFree(entry) && 0 < entry.length && strcmp(entry.name.str, ".") != 0 &&
+				    strcmp(entry.name.str, "..") != 0 && (status = collect(entry)) < 0)
+					return status;
+
+			return 0;
+		};
+
+		if ((status = collect(getRoot(nullptr, true))) < 0)
+			return status;
+
+		compactEntries = true;
+		nameSlots.clear();
+		nameBlockUsage.clear();
+
+		// Directory lengths shrink along with their entries, and every copy of a directory's entry (including "." and
+		// "..") has to agree.
+		for (auto &[start, entries]: dirs)
+			for (DirEntry &entry: entries)
+				if (entry.isDirectory()) {
+					auto iter = dirs.find(entry.startBlock);
+					if (iter != dirs.end())
+						entry.length = iter->second.size() * sizeof(CompactEntry);
+				}
+
+		const size_t bs = superblock.blockSize;
+		const size_t per_block = bs / sizeof(CompactEntry);
+		for (auto &[start, entries]: dirs) {
+			const std::vector<block_t> blocks = blockMap(start);
+			const size_t needed = std::max<size_t>(1, updiv(entries.size(), per_block));
+			if (blocks.size() < needed) {
+				compactEntries = false;
+				return -EIO;
+			}
+
+			for (size_t i = 0; i < entries.size(); ++i) {
+				// There's far less room for inline data in the new format.
+				DirEntry &entry = entries[i];
+				if (entry.isInline() && inlineCapacity(entry) < entry.length &&
+				    (status = spill(entry, entry.inlineData())) < 0)
+					return status;
+				if ((status = storeEntry(entry, blocks[i / per_block] * bs + (i % per_block) *
+				     sizeof(CompactEntry))) < 0)
+					return status;
+			}
+
+			for (size_t i = needed; i < blocks.size(); ++i)
+				writeFAT(0, blocks[i]);
+			writeFAT(FINAL, blocks[needed - 1]);
+			forgetBlockMap(start);
+		}
+
+		superblock.magic = MAGIC_V2;
+		const ssize_t written = partition->write(&superblock, sizeof(Superblock), 0);
+		if (written < 0)
+			return written;
+
+		// Every entry has moved, so nothing cached by offset is valid anymore.
+		clearDentries();
+		dirInfos.clear();
+		getRoot(nullptr, true);
+		indexChecked = false;
+		if (loadIndex() && (status = rebuildIndex()) < 0)
+			return status;
+
+		return sync();
+	}
+
 	int ThornFATDriver::writeEntry(const DirEntry &dir, off_t offset) {
 		HELLO(dir.name.str);
 		ENTER;
 		DBGF(WRENTRYH, "Writing directory entry at offset " BLR " (" BLR DMS BLR DL BLR ") with filename " BSTR DM
 			" length " BUR DM " start block " BDR " (next: " BDR ")",
-			offset, offset / superblock.blockSize, (offset % superblock.blockSize) / sizeof(DirEntry),
-			(offset % superblock.blockSize) % sizeof(DirEntry),  dir.name.str, dir.length, dir.startBlock,
+			offset, offset / superblock.blockSize, (offset % superblock.blockSize) / entrySize(),
+			(offset % superblock.blockSize) % entrySize(),  dir.name.str, dir.length, dir.startBlock,
 			readFAT(dir.startBlock));
 
 		// CHECKSEEK(WRENTRYH, "Invalid offset:", offset);
 		// lseek(imgfd, offset, SEEK_SET);
 		// IFERRNOXC(WARN(WRENTRYH, "lseek() failed " UDARR " " DSR, strerror(errno)));
 
-		ssize_t status = partition->write(&dir, sizeof(DirEntry), offset);
+		ssize_t status = storeEntry(dir, offset);
 		if (status < 0) {
 			DBGF(WRENTRYH, "Writing failed: %ld", status);
-			return -status;
+			return status;
 		}
+
+		updateDentry(dir, offset);
+		for (auto &[fd, open_file]: openFiles)
+			if (open_file.offset == offset && &open_file.entry != &dir)
+				open_file.entry = dir;
 		// IFERRNOXC(WARN(WRENTRYH, "write() failed " UDARR " " DSR, strerror(errno)));
 
 		if (offset == superblock.startBlock * superblock.blockSize) {
 			// If we're writing to "." in the root, update ".." as well.
 			// We need to make a copy of the entry so we can change its filename to "..".
 			DirEntry dir_cpy = dir;
-			memset(dir_cpy.name.str, 0, sizeof(dir_cpy.name.str));
-			dir_cpy.name.str[0] = dir_cpy.name.str[1] = '.';
+			updateName(dir_cpy, "..");
 			// write(imgfd, &dir_cpy, sizeof(DirEntry));
-			status = partition->write(&dir_cpy, sizeof(DirEntry), offset + sizeof(DirEntry));
+			status = storeEntry(dir_cpy, offset + entrySize());
 			SCHECKX(WRENTRYH, "Writing failed");
 		}
 
@@ -288,7 +1368,7 @@ namespace ThornFAT {
 			return root;
 		}
 
-		ssize_t status = partition->read(&root, sizeof(DirEntry), start);
+		ssize_t status = loadEntry(root, start);
 		if (status < 0)
 			DBGF(GETROOTH, "Reading failed: %ld", status);
 
@@ -314,189 +1394,144 @@ namespace ThornFAT {
 			return -ENOTDIR;
 		}
 
-		if (dir.length % sizeof(DirEntry) != 0)
-			WARN("readDir", "Directory length " BDR " isn't a multiple of DirEntry size " BLR ".", dir.length,
-				sizeof(DirEntry));
-
-		DBGF("readDir", "%s", std::string(dir).c_str());
+		if (dir.length % entrySize() != 0)
+			WARN("readDir", "Directory length " BDR " isn't a multiple of the entry size " BLR ".", dir.length,
+				entrySize());
 
-		const size_t count = dir.length / sizeof(DirEntry);
 		entries.clear();
-		entries.resize(count);
-		DBGFE("readDir", "count = " BULR, count);
-
+		entries.reserve(dir.length / entrySize());
 		if (offsets) {
 			offsets->clear();
-			offsets->resize(count);
+			offsets->reserve(dir.length / entrySize());
 		}
 
-		std::vector<uint8_t> raw;
-		size_t byte_c;
-
-		DBGFE("readDir", "About to read from " BSR, std::string(dir).c_str());
+		int status = iterateDir(dir, [&](const DirEntry &entry, off_t offset) {
+			DBGFE("readDir", "[offset=%5ld] %s", offset, std::string(entry).c_str());
+			entries.push_back(entry);
+			if (offsets)
+				offsets->push_back(offset);
+			return true;
+		});
 
-		int status = readFile(dir, raw, &byte_c);
 		if (status < 0) {
 			DR_EXIT;
-			DBGF("readDir", "readFile failed: " BDR, status);
+			DBGF("readDir", "iterateDir failed: " BDR, status);
 			return status;
 		}
 
-		// for (uint8_t ch: raw)
-		// 	DEBUG("%x ", ch & 0xff);
-		// DEBUG("\n");
-
-		char first_name[THORNFAT_PATH_MAX + 1];
-		memcpy(first_name, raw.data() + offsetof(DirEntry, name), THORNFAT_PATH_MAX);
-		if (strcmp(first_name, ".") == 0) {
-			// The directory contains a "." entry, presumably in addition to a ".." entry.
-			// This means there are two meta-entries before the actual entries.
-			if (first_index)
+		if (first_index && !entries.empty()) {
+			if (strcmp(entries[0].name.str, ".") == 0) {
+				// The directory contains a "." entry, presumably in addition to a ".." entry.
+				// This means there are two meta-entries before the actual entries.
 				*first_index = 2;
-		} else if (strcmp(first_name, "..") == 0) {
-			// The directory appears to contain just ".." and not "." (unless the order is reversed,
-			// but that should never happen). This means there's just one meta-entry.
-			if (first_index)
+			} else if (strcmp(entries[0].name.str, "..") == 0) {
+				// The directory appears to contain just ".." and not "." (unless the order is reversed,
+				// but that should never happen). This means there's just one meta-entry.
 				*first_index = 1;
+			}
 		}
 
-		DBGFE("readDir", "first_name = \"" BSR "\", byte_c = " BULR ", count = " BULR, first_name, byte_c, count);
-
-		// for (size_t i = 0; i < raw.size(); ++i)
-		// 	DEBUG("[%lu] '%c' (%d)\n", i, raw[i], raw[i]);
-
-		block_t block = dir.startBlock;
-		int rem;
-
-		for (size_t i = 0; i < count; ++i) {
-			memcpy(entries.data() + i, raw.data() + sizeof(DirEntry) * i, sizeof(DirEntry));
-
-			// for (size_t j = 0; j < sizeof(DirEntry); ++j) {
-			// 	const char ch = *(raw.data() + sizeof(DirEntry) * i + j);
-			// 	if (ch == '\0')
-			// 		DEBUG("[%lu] \\0\n", j);
-			// 	else
-			// 		DEBUG("[%lu] %c\n", j, ch);
-			// }
+		DR_EXIT;
+		return 0;
+	}
 
-			DirEntry entry;
-			memcpy(&entry, raw.data() + sizeof(DirEntry) * i, sizeof(DirEntry));
-			DBGFE("readDir", "[i=%d, offset=%5lu] %s", i, sizeof(DirEntry) * i, std::string(entry).c_str());
+	int ThornFATDriver::iterateDir(const DirEntry &dir, const DirVisitor &visitor, const Filename *search,
+	                               uint64_t search_hash) {
+		if (dir.length == 0 || !dir.isDirectory())
+			return -ENOTDIR;
 
-			const int entries_per_block = superblock.blockSize / sizeof(DirEntry);
-			rem = i % entries_per_block;
+		const size_t bs = superblock.blockSize;
+		const size_t entry_size = entrySize();
+		const size_t per_block = bs / entry_size;
+		size_t remaining = dir.length / entry_size;
+		std::vector<uint8_t> buffer(per_block * entry_size);
+
+		for (block_t block = dir.startBlock; 0 < remaining; block = readFAT(block)) {
+			if (!checkBlock(block)) {
+				WARN("iterateDir", "Invalid block " BDR " in directory " BSTR, block, dir.name.str);
+				return -EIO;
+			}
 
-			if (offsets)
-				(*offsets)[i] = block * superblock.blockSize + rem * sizeof(DirEntry);
+			const size_t in_block = std::min(remaining, per_block);
+			ssize_t status = partition->read(buffer.data(), in_block * entry_size, block * bs);
+			if (status < 0)
+				return status;
 
-			if (rem == entries_per_block - 1)
-				block = readFAT(block);
-		}
+			for (size_t i = 0; i < in_block; ++i) {
+				DirEntry entry;
+				const off_t offset = block * bs + i * entry_size;
+				if ((status = decodeEntry(buffer.data() + i * entry_size, offset, entry, search, search_hash)) < 0)
+					return status;
+				if (!visitor(entry, offset))
+					return 0;
+			}
 
-		for (const DirEntry &entry: entries) {
-			(void) entry;
-			DBGFE("readDir", "Entry: " BSR, std::string(entry).c_str());
+			remaining -= in_block;
 		}
 
-		DR_EXIT;
 		return 0;
 	}
 
-	int ThornFATDriver::readFile(const DirEntry &file, std::vector<uint8_t> &out, size_t *count) {
-		ENTER;
-		DBGF(FILEREADH, "Reading file \"" BSR "\" of length " BULR " @ " BDR, file.name.str, file.length,
-			file.startBlock * superblock.blockSize);
-		// DBGF("readFile", "file.startBlock = " BDR ", superblock.blockSize = " BUR, file.startBlock,
-		// 	superblock.blockSize);
-		if (file.length == 0) {
-			if (count)
-				*count = 0;
-			EXIT;
-			return 0;
-		}
-
-		const auto bs = superblock.blockSize;
-		// DEBUG("[ThornFATDriver::readFile] bs = %u\n", bs);
+	ssize_t ThornFATDriver::transfer(block_t block, size_t offset, void *buffer, size_t size, bool writing,
+	                                 block_t *last_out) {
+		const size_t bs = superblock.blockSize;
+		char *bytes = static_cast<char *>(buffer);
+		const std::vector<block_t> &map = blockMap(block);
+		const size_t block_count = map.size();
+
+		// The block map turns the offset into a chain index directly instead of walking the FAT from the start.
+		size_t index = offset / bs;
+		offset %= bs;
+
+		size_t done = 0;
+		while (done < size) {
+			if (block_count <= index || map[index] == HOLE) {
+				if (writing) {
+					// This won't happen unless the code is bad or the disk image is corrupted.
+					WARN(WRITEH, "There are still " BLR " byte%s left, but block " BLR " of the chain isn't allocated",
+						PLURALS(size - done), index);
+					break;
+				}
 
-		if (count)
-			*count = file.length;
+				// Nothing is stored for holes or the implied hole past the end of a sparse file's chain.
+				size_t run_bytes = std::min(bs - offset, size - done);
+				while (done + run_bytes < size && (block_count <= index + 1 || map[index + 1] == HOLE)) {
+					++index;
+					run_bytes += std::min(bs, size - done - run_bytes);
+				}
 
-		out.clear();
-		out.resize(file.length, '*');
-		uint8_t *ptr = out.data();
-		size_t remaining = file.length;
-		block_t block = file.startBlock;
-		while (0 < remaining) {
-			if (remaining <= bs) {
-				checkBlock(block);
-				ssize_t status = partition->read(ptr, remaining, block * bs);
-				SCHECK(FILEREADH, "Couldn't read from partition");
-				ptr += remaining;
-				remaining = 0;
-
-				block_t nextblock = readFAT(block);
-				if (nextblock != FINAL) {
-					// The file should end here, but the file allocation table says there are still more blocks.
-#ifdef SHRINK_DIRS
-					const bool shrink = true;
-#else
-					const bool shrink = false;
-#endif
+				memset(bytes + done, 0, run_bytes);
+				done += run_bytes;
+				offset = 0;
+				++index;
+				continue;
+			}
 
-					if (!shrink || !file.isDirectory()) {
-						WARN(FILEREADH, "%s " BSR " has no bytes left, but the file allocation table says more blocks "
-							"are allocated to it.", file.isFile()? "File" : "Directory", file.name.str);
-						WARN(FILEREADH, SUB "remaining = " BDR DM " readFAT(" BDR ") = " BDR DM " bs = " BDR, remaining,
-							block, readFAT(block), bs);
-					} else {
-						WARN(FILEREADH, "%s " BSR " has extra FAT blocks; trimming.",
-							file.isFile()? "File" : "Directory", file.name.str);
-						writeFAT(FINAL, block);
-						DBGF(FILEREADH, BDR " ← FINAL", block);
-						block_t shrinkblock = nextblock;
-						for (;;) {
-							nextblock = readFAT(shrinkblock);
-							if (nextblock == FINAL) {
-								DBG(FILEREADH, "Finished shrinking (FINAL).");
-								break;
-							} else if (nextblock == 0) {
-								DBG(FILEREADH, "Finished shrinking (0).");
-								break;
-							} else if ((block_t) superblock.fatBlocks <= nextblock) {
-								WARN(FILEREADH, "FAT[" BDR "] = " BDR ", outside of FAT (" BDR " block%s)", shrinkblock,
-									nextblock, superblock.fatBlocks, superblock.fatBlocks == 1? "" : "s");
-								break;
-							}
-
-							writeFAT(0, shrinkblock);
-							++blocksFree;
-							shrinkblock = nextblock;
-						}
-					}
-				}
-			} else {
-				if (readFAT(block) == FINAL) {
-					// There's still more data that should be remaining after this block, but
-					// the file allocation table says the file doesn't continue past this block.
-
-					WARN(FILEREADH, "File still has " BDR " byte%s left, but the file allocation table doesn't have a "
-						"next block after " BDR ".", PLURALS(remaining), block);
-					EXIT;
-					return -EINVAL;
-				} else {
-					checkBlock(block);
-					DBGF(FILEREADH, "block * bs = " BUR, block * bs);
-					ssize_t status = partition->read(ptr, bs, block * bs);
-					SCHECK(FILEREADH, "Couldn't read from partition");
-					ptr += bs;
-					remaining -= bs;
-					block = readFAT(block);
-				}
+			// Extend the run for as long as the chain continues into the physically next block.
+			const size_t run_start = index;
+			size_t run_bytes = std::min(bs - offset, size - done);
+			while (done + run_bytes < size && index + 1 < block_count && map[index + 1] == map[index] + 1) {
+				++index;
+				run_bytes += std::min(bs, size - done - run_bytes);
 			}
+
+			const size_t position = map[run_start] * bs + offset;
+			DBGF(writing? "transfer (write)" : "transfer (read)", "Run of " BLR " byte%s at block " BDR,
+				PLURALS(run_bytes), map[run_start]);
+			const ssize_t status = writing? partition->write(bytes + done, run_bytes, position)
+			                              : partition->read(bytes + done, run_bytes, position);
+			if (status < 0)
+				return status;
+
+			if (last_out)
+				*last_out = map[index];
+
+			done += run_bytes;
+			offset = 0;
+			++index;
 		}
 
-		EXIT;
-		return 0;
+		return done;
 	}
 
 	int ThornFATDriver::newFile(const char *path, size_t length, FileType type, const Times *times,
@@ -533,6 +1568,9 @@ namespace ThornFAT {
 			return -ENAMETOOLONG;
 		}
 
+		// A cached miss for this name is about to become wrong.
+		forgetDentry(dentryKey(parent_offset, last_name));
+
 		// TODO: implement time.
 		DirEntry newfile(times == NULL? Times(0, 0, 0) : *times, length, type);
 		block_t free_block = findFreeBlock();
@@ -542,53 +1580,50 @@ namespace ThornFAT {
 			// free block is available if the parent directory has enough space for another entry.
 			newfile.startBlock = 0;
 		} else {
-			// We'll need at least one free block to store the new file in so we can
-			// store the starting block in the directory entry we'll create soon.
-			if (free_block == UNUSABLE) {
-				// If we don't have one, we'll complain about having no space left and give up.
-				WARNS(NEWFILEH, "No free block " UDARR " " IDS("ENOSPC"));
-				NF_EXIT;
-				return -ENOSPC;
-			}
-
-			SUCC(NEWFILEH, "Allocated " BSR " at block " BDR ".", path, free_block);
-
-			// Allocate the first block and decrement the free blocks count.
-			writeFAT(FINAL, free_block);
-			--blocksFree;
-			newfile.startBlock = free_block;
-
 			// There's not a point in copying the name to the entry if this function
 			// is being called just to get an offset to move an existing entry to.
 			memcpy(newfile.name.str, last_name.c_str(), ln_length);
+			newfile.updateHash();
+
+			if (type == FileType::File && length <= inlineCapacity(newfile)) {
+				// Small files start out inside their directory entry and only get a block once they outgrow it.
+				newfile.startBlock = INLINE;
+			} else {
+				// We'll need at least one free block to store the new file in so we can
+				// store the starting block in the directory entry we'll create soon.
+				if (free_block == UNUSABLE) {
+					// If we don't have one, we'll complain about having no space left and give up.
+					WARNS(NEWFILEH, "No free block " UDARR " " IDS("ENOSPC"));
+					NF_EXIT;
+					return -ENOSPC;
+				}
+
+				SUCC(NEWFILEH, "Allocated " BSR " at block " BDR ".", path, free_block);
+
+				// Allocate the first block. writeFAT takes care of the free block count.
+				writeFAT(FINAL, free_block);
+				newfile.startBlock = free_block;
+			}
 		}
 
 		block_t old_free_block = free_block;
 
-		// Read the directory to check whether there's a freed entry we can recycle. This can save us a lot of pain.
-		std::vector<DirEntry> entries;
-		std::vector<off_t> offsets;
-		int first_index;
-		status = readDir(parent, entries, &offsets, &first_index);
-		SCHECK(NEWFILEH, "readDir failed");
-		size_t count = entries.size();
+		// Check whether there's a freed entry we can recycle. This can save us a lot of pain.
+		DirInfo *info = dirInfo(parent);
+		if (!info) {
+			WARNS(NEWFILEH, "Couldn't read parent directory");
+			NF_EXIT;
+			return -EIO;
+		}
 
-		// Check all the directory entries except the initial meta-entries.
 		off_t offset = -1;
-		size_t offset_index = -1;
-		for (size_t i = (size_t) first_index; i < count; ++i) {
-			// DEBUG("[%lu] free(%d): %s\n", i, isFree(entries[i])? 1 : 0, std::string(entries[i]).c_str());
-			if (isFree(entries[i])) {
-				// We found one! Store its offset in `offset` to replace its previous value of -1.
-				offset = offsets[i];
-				offset_index = i;
-				SUCC(NEWFILEH, ICS("Found") " freed entry at offset " BLR ".", offset);
-				break;
-			}
+		if (!info->freeSlots.empty()) {
+			offset = *info->freeSlots.begin();
+			SUCC(NEWFILEH, ICS("Found") " freed entry at offset " BLR ".", offset);
 		}
 
 		const size_t bs = superblock.blockSize;
-		const uint64_t block_c = updiv(length, bs);
+		const uint64_t block_c = newfile.isInline()? 0 : updiv(length, bs);
 
 		// There are four different scenarios that we have to accommodate when we want to add a new directory entry.
 		// The first and easiest is when the parent directory has a slot that used to contain an entry but was later
@@ -612,14 +1647,10 @@ namespace ThornFAT {
 			// }
 			SCHECK(NEWFILEH, "Couldn't add entry to parent directory");
 
-
-			DBGF(NEWFILEH, "[S1] parent->length" SDEQ BUR DMS "offset_index" SDEQ BULR DMS "parent->length / "
-				"sizeof(DirEntry)" SDEQ BULR, parent.length, offset_index, parent.length / sizeof(DirEntry));
-			if (offset_index < parent.length / sizeof(DirEntry)) {
-				// Don't increase the length if it already extends past this entry.
-				increase_parent_length = false;
-			}
-		} else if (parent.length <= bs - sizeof(DirEntry)) {
+			// Free slots are always within the parent's length, so it doesn't need to grow.
+			info->freeSlots.erase(offset);
+			increase_parent_length = false;
+		} else if (parent.length <= bs - entrySize()) {
 			// Scenario two: the parent directory has free space in its first block, which is also pretty easy to deal
 			// with.
 			CDBGS(A_CYAN, NEWFILEH, "Scenario two.");
@@ -642,39 +1673,29 @@ namespace ThornFAT {
 			// Scenarios three and four: the parent directory spans multiple blocks.
 			// Four is mercifully simple, three less so.
 
-			// Skip to the last block; we don't need to read or change anything in the earlier blocks.
-			size_t remaining = parent.length;
-			block_t block = parent.startBlock;
-			DBGN(NEWFILEH, "Parent start block:", block);
-			int skipped = 0;
-			while (bs < remaining) {
-				block = readFAT(block);
-				remaining -= bs;
-				if (++skipped <= NEWFILE_SKIP_MAX)
-					DBGN(NEWFILEH, "  Skipping to", block);
-			}
-
-			if (NEWFILE_SKIP_MAX < skipped)
-				DBGF(NEWFILEH, "  " IDS("... %d more"), skipped);
+			// Go straight to the last block; we don't need to read or change anything in the earlier blocks.
+			const size_t remaining = parent.length - (parent.length - 1) / bs * bs;
+			block_t block = info->tailBlock;
+			DBGN(NEWFILEH, "Parent tail block:", block);
 
-			DBGF(NEWFILEH, "bs - sizeof(DirEntry) < remaining  " UDBARR "  " BLR " - " BLR " < " BLR "  " UDBARR "  "
-				BLR " < " BLR, bs, sizeof(DirEntry), remaining, bs - sizeof(DirEntry), remaining);
+			DBGF(NEWFILEH, "bs - entrySize() < remaining  " UDBARR "  " BLR " - " BLR " < " BLR "  " UDBARR "  "
+				BLR " < " BLR, bs, entrySize(), remaining, bs - entrySize(), remaining);
 
-			if (bs - sizeof(DirEntry) < remaining) {
+			if (bs - entrySize() < remaining) {
 				// Scenario three, the worst one: there isn't enough free space left in the
 				// parent directory to fit in another entry, so we have to add another block.
 				CDBGS(A_CYAN, NEWFILEH, "Scenario three.");
 
 				bool nospc = false;
 
-				if (!noalloc && !hasFree(2 + block_c)) {
+				if (!noalloc && !newfile.isInline() && !hasFree(2 + block_c)) {
 					// We need to make sure we have at least two free blocks: one for the expansion of the parent
 					// directory and another for the new directory entry. We also need more free blocks to contain the
 					// file, but that's mostly handled by the for loop below.
 					// TODO: is it actually 1 + block_c?
 					writeFAT(0, old_free_block);
 					nospc = true;
-				} else if (noalloc && !hasFree(1)) {
+				} else if ((noalloc || newfile.isInline()) && !hasFree(1)) {
 					// If we don't need to allocate space for the new file,
 					// we need only one extra block for the parent directory.
 					nospc = true;
@@ -689,10 +1710,13 @@ namespace ThornFAT {
 
 				// We'll take the value from the free block we found earlier to use as the next block in the parent
 				// directory.
-				writeFAT(block, old_free_block);
+				forgetBlockMap(parent.startBlock);
+				writeFAT(old_free_block, block);
+				writeFAT(FINAL, old_free_block);
 				block = old_free_block;
+				info->tailBlock = block;
 
-				if (!noalloc) {
+				if (!noalloc && !newfile.isInline()) {
 					// If we need to allocate space for the new file, we now try to find
 					// another free block to use as the new file's start block.
 					free_block = findFreeBlock();
@@ -703,8 +1727,9 @@ namespace ThornFAT {
 						return -ENOSPC;
 					}
 
-					// Decrease the free block count and assign the free block as the new file's starting block.
-					--blocksFree;
+					// Assign the free block as the new file's starting block. It has to be claimed now so that a
+					// long name block allocated by writeEntry can't land on it.
+					writeFAT(FINAL, free_block);
 					newfile.startBlock = free_block;
 				}
 
@@ -726,8 +1751,9 @@ namespace ThornFAT {
 			// Increase the size of the parent directory and write it back to its original offset.
 			DBG(NEWFILEH, IMS("Increasing parent length."));
 			DBGFE(NEWFILEH, "Parent length" DLS BDR SUDARR BDR, parent.length, (uint32_t) (parent.length +
-				sizeof(DirEntry)));
-			parent.length += sizeof(DirEntry);
+				entrySize()));
+			parent.length += entrySize();
+			info->length = parent.length;
 			status = writeEntry(parent, parent_offset);
 			SCHECKX(NEWFILEH, "Couldn't write the parent directory to disk");
 		}
@@ -735,25 +1761,20 @@ namespace ThornFAT {
 		if (!noalloc) {
 			// If the file is more than one block in length, we need to allocate more entries in the file allocation
 			// table.
-			block_t block = newfile.startBlock;
-			for (auto size_left = length; bs < size_left; size_left -= bs) {
-				block_t another_free_block = findFreeBlock();
-				if (another_free_block == UNUSABLE) {
-					writeFAT(FINAL, block);
-					blocksFree = -1;
+			if (1 < block_c) {
+				std::vector<block_t> rest;
+				if (allocateBlocks(block_c - 1, newfile.startBlock + 1, rest) != 0) {
 					writeFAT(0, old_free_block);
 					WARN(NEWFILEH, "No free block " UDARR " " DSR, "ENOSPC");
-					countFree();
 					NF_EXIT;
 					return -ENOSPC;
 				}
 
-				--blocksFree;
-				writeFAT(another_free_block, block);
-				block = another_free_block;
-			}
+				writeFAT(rest.front(), newfile.startBlock);
+			} else if (!newfile.isInline())
+				writeFAT(FINAL, newfile.startBlock);
 
-			writeFAT(FINAL, block);
+			indexInsert(parent.startBlock, newfile.name.str, offset);
 		}
 
 		if (dir_out)
@@ -802,6 +1823,8 @@ namespace ThornFAT {
 		forget(found.startBlock);
 		found.startBlock = 0;
 		writeEntry(found, offset);
+		releaseSlot(path, offset);
+		maybeCompact(path);
 
 		return 0;
 	}
@@ -816,6 +1839,23 @@ namespace ThornFAT {
 			return 0;
 		}
 
+		if (file.isInline()) {
+			int status;
+			if (new_size <= inlineCapacity(file)) {
+				// Bytes past the end of inline data are kept zeroed, so growing doesn't have to clear anything.
+				if (new_size < file.length)
+					memset(file.inlineData() + new_size, 0, file.length - new_size);
+				file.length = new_size;
+				status = writeEntry(file, file_offset);
+				SCHECKX(RESIZEH, "fat_write_entry failed");
+				EXIT;
+				return 0;
+			}
+
+			status = spill(file, file.inlineData());
+			SCHECKX(RESIZEH, "Couldn't move inline data out of the entry");
+		}
+
 		size_t old_calculated;
 		const size_t new_c = updiv(new_size, static_cast<size_t>(superblock.blockSize));
 		const size_t old_apparent = updiv(file.length, static_cast<size_t>(superblock.blockSize));
@@ -824,7 +1864,7 @@ namespace ThornFAT {
 			WARNS(RESIZEH, "Trying to resize a free file. Defaulting to apparent block length.");
 			old_calculated = old_apparent;
 		} else {
-			old_calculated = chainLength(file.startBlock);
+			old_calculated = readFAT(file.startBlock) == 0? 0 : blockMap(file.startBlock).size();
 		}
 
 		const size_t old_c = old_calculated;
@@ -841,103 +1881,261 @@ namespace ThornFAT {
 			// Update the file length and then save the directory entry.
 			file.length = 0;
 			writeEntry(file, file_offset);
-		} else if (old_c == new_c) {
-			DBGF(RESIZEH, "No change in block count (" BLR ")", old_c);
-			// Easy: no block boundaries need to be crossed.
+		} else if (new_size < file.length) {
+			// We need to zero out the end.
+			int status = zeroOutFree(file, new_size);
+			SCHECKX(RESIZEH, "fat_zero_out_free status");
 
-			int status;
-			if (new_size < file.length) {
-				// We need to zero out the end.
-				status = zeroOutFree(file, new_size);
-				SCHECKX(RESIZEH, "fat_zero_out_free status");
+			if (new_c < old_c) {
+				DBGF(RESIZEH, "Reducing block count from " BLR " to " BLR ".", old_c, new_c);
+
+				// Copy the chain because encodeChain replaces the cached map.
+				std::vector<block_t> blocks = blockMap(file.startBlock);
+				const std::vector<block_t> freed(blocks.begin() + new_c, blocks.end());
+				blocks.resize(new_c);
+				status = encodeChain(file, std::move(blocks));
+				SCHECKX(RESIZEH, "encodeChain failed");
+
+				// Holes past the new end disappear along with their markers.
+				for (const block_t block: freed)
+					if (block != HOLE) {
+						DBGN(RESIZEH, ILS("Freeing") " a FAT block:", block);
+						writeFAT(0, block);
+					}
 			}
 
-			DBGF(RESIZEH, ICS("Trying to change file" DARR "length") " at " BLR " from " BDR " byte(s) to " BLR " byte(s)",
+			DBGN(RESIZEH, "Setting new byte length to", new_size);
+			file.length = new_size;
+			status = writeEntry(file, file_offset);
+			SCHECKX(RESIZEH, "fat_write_entry failed");
+		} else {
+			// Nothing is allocated for the added range; it's a hole until something is written there. Only the part
+			// of it that lies in blocks the chain already has needs clearing.
+			int status = zeroRange(file, file.length, new_size);
+			SCHECKX(RESIZEH, "zeroRange failed");
+
+			DBGF(RESIZEH, "Trying to change file" DARR "length at offset " BLR " from " BDR " to " BLR ".",
 				file_offset, file.length, new_size);
 			file.length = new_size;
 			status = writeEntry(file, file_offset);
 			SCHECKX(RESIZEH, "fat_write_entry status");
-		} else if (new_c < old_c) {
-			// Less easy: we have to shrink the file.
+		}
+
+		SUCCS(RESIZEH, "Successfully resized.");
+		EXIT; return 0;
+	}
+
+	int ThornFATDriver::allocateRange(DirEntry &file, size_t offset, size_t size) {
+		if (file.startBlock <= 0) {
+			WARNS(WRITEH, "Trying to write to a file without a chain.");
+			return -EINVAL;
+		}
+
+		const size_t bs = superblock.blockSize;
+		const size_t end = offset + size;
+		const size_t new_length = std::max<size_t>(file.length, end);
+
+		// Whatever the write skips over between the old end of the file and its start has to read as zeroes. Holes
+		// already do, so this only writes to blocks that are allocated.
+		int status = zeroRange(file, file.length, offset);
+		if (status < 0)
+			return status;
+
+		if (size != 0) {
+			std::vector<std::pair<size_t, block_t>> added;
+			if ((status = fillBlocks(file, offset / bs, (end - 1) / bs, added)) < 0)
+				return status;
+
+			// New blocks still hold whatever was there before. That's only a problem for the parts the write doesn't
+			// cover but the file does, which happens when a write lands in the middle of a hole.
+			std::vector<char> zeros;
+			for (const auto &[index, block]: added) {
+				const size_t block_start = index * bs;
+				const size_t block_end = std::min(block_start + bs, new_length);
+				const size_t position = size_t(block) * bs;
+				if (zeros.empty() && (block_start < offset || end < block_end))
+					zeros.resize(bs, 0);
+				if (block_start < offset &&
+				    (status = partition->write(zeros.data(), offset - block_start, position)) < 0)
+					return status;
+				if (end < block_end &&
+				    (status = partition->write(zeros.data(), block_end - end, position + end - block_start)) < 0)
+					return status;
+			}
+		}
+
+		file.length = new_length;
+		return 0;
+	}
+
+	int ThornFATDriver::fillBlocks(DirEntry &file, size_t first, size_t last,
+	                               std::vector<std::pair<size_t, block_t>> &added) {
+		added.clear();
+		std::vector<block_t> map = blockMap(file.startBlock);
+		if (map.empty())
+			map.push_back(file.startBlock);
+
+		std::vector<size_t> needed;
+		for (size_t i = first; i <= last; ++i)
+			if (map.size() <= i || map[i] == HOLE)
+				needed.push_back(i);
+
+		if (needed.empty())
+			return 0;
+
+		// Try to continue from the last allocated block before the range.
+		block_t preferred = 0;
+		for (size_t i = std::min(first, map.size()); 0 < i; --i)
+			if (map[i - 1] != HOLE) {
+				preferred = map[i - 1] + 1;
+				break;
+			}
+
+		DBGF(WRITEH, "Trying to add " BLR " block%s", PLURALS(needed.size()));
+		std::vector<block_t> blocks;
+		if (allocateBlocks(needed.size(), preferred, blocks) != 0) {
+			WARNS(WRITEH, "Out of space " UDARR " " IDS("ENOSPC"));
+			return -ENOSPC;
+		}
+
+		if (map.size() <= last)
+			map.resize(last + 1, HOLE);
+		for (size_t i = 0; i < needed.size(); ++i)
+			map[needed[i]] = blocks[i];
+
+		const int status = encodeChain(file, std::move(map));
+		if (status < 0) {
+			for (const block_t block: blocks)
+				writeFAT(0, block);
+			return status;
+		}
+
+		for (size_t i = 0; i < needed.size(); ++i)
+			added.emplace_back(needed[i], blocks[i]);
+		return 0;
+	}
 
-			DBGF(RESIZEH, "Reducing block count from " BLR " to " BLR ".", old_c, new_c);
+	int ThornFATDriver::encodeChain(DirEntry &file, std::vector<block_t> map) {
+		while (1 < map.size() && map.back() == HOLE)
+			map.pop_back();
 
-			auto blocks = std::make_unique<block_t[]>(old_c);
-			block_t block = file.startBlock;
-			for (size_t i = 0; i < old_c; ++i) {
-				blocks[i] = block;
-				DBGN(RESIZEH, IMS("Noting") " a FAT block:", blocks[i]);
-				block = readFAT(block);
+		if (map.empty() || map.front() <= 0) {
+			WARNS("encodeChain", "A chain has to start with an allocated block.");
+			return -EINVAL;
+		}
+
+		const size_t bs = superblock.blockSize;
+		const std::vector<block_t> &old_map = blockMap(file.startBlock);
+		const bool old_sparse = std::find(old_map.begin(), old_map.end(), HOLE) != old_map.end();
+		const bool new_sparse = std::find(map.begin(), map.end(), HOLE) != map.end();
+
+		std::vector<block_t> old_markers;
+		if (old_sparse)
+			for (block_t block = file.startBlock; 0 < block; block = readFAT(block))
+				if (holeMarker(block))
+					old_markers.push_back(block);
+
+		// Each run of holes takes up a single marker block in the chain.
+		std::vector<std::pair<block_t, uint64_t>> links;
+		std::vector<block_t> new_markers;
+		size_t reused = 0;
+		for (size_t i = 0; i < map.size();) {
+			if (map[i] != HOLE) {
+				links.emplace_back(map[i++], 0);
+				continue;
 			}
 
-			DBGE(RESIZEH, "About to zero out free space.");
-			int status = zeroOutFree(file, new_size);
-			SCHECKX(RESIZEH, "fat_zero_out_free status");
+			uint64_t run = 0;
+			for (; i < map.size() && map[i] == HOLE; ++i)
+				++run;
 
-			for (size_t i = new_c; i < old_c; ++i) {
-				DBGN(RESIZEH, ILS("Freeing") " a FAT block:", blocks[i]);
-				writeFAT(0, blocks[i]);
-				++blocksFree;
+			block_t marker;
+			bool fresh = false;
+			if (reused < old_markers.size()) {
+				marker = old_markers[reused++];
+			} else {
+				marker = findFreeBlock();
+				if (marker == UNUSABLE) {
+					for (const block_t block: new_markers)
+						writeFAT(0, block);
+					WARNS("encodeChain", "No room for a hole marker.");
+					return -ENOSPC;
+				}
+				writeFAT(FINAL, marker);
+				new_markers.push_back(marker);
+				fresh = true;
 			}
 
-			if (0 < new_c) {
-				DBGN(RESIZEH, ILS("Ending") " a FAT block:", blocks[new_c - 1]);
-				writeFAT(FINAL, blocks[new_c - 1]);
+			if (fresh || holeCount(marker) != run) {
+				const ssize_t status = partition->write(&run, sizeof(run), size_t(marker) * bs);
+				if (status < 0) {
+					for (const block_t block: new_markers)
+						writeFAT(0, block);
+					return status;
+				}
+				holeCounts[marker] = run;
 			}
 
-			DBGN(RESIZEH, "Setting new byte length to", new_size);
-			file.length = new_size;
-			status = writeEntry(file, file_offset);
-			SCHECKX(RESIZEH, "fat_write_entry failed");
-		} else {
-			DBGF(RESIZEH, "Increasing block count from " BLR " to " BLR ".", old_c, new_c);
-
-			// The tricky one: we have to absorb more blocks.
-			// Let's first make sure we can add enough additional blocks.
-			size_t to_add = new_c - (old_c? old_c : 1);
-			DBGF(RESIZEH, "Trying to add " BLR " block%s", PLURALS(to_add));
-			if (!hasFree(to_add)) {
-				WARNS(RESIZEH, "Not enough blocks " UDARR " " IDS("ENOSPC"));
-				EXIT;
-				return -ENOSPC;
-			}
+			links.emplace_back(marker, run);
+		}
 
-			block_t new_block;
-			block_t block = file.startBlock;
-			size_t added = 0;
+		// Without any markers involved, the links before the first difference are already right.
+		size_t first_link = 0;
+		if (!old_sparse && !new_sparse) {
+			while (first_link < old_map.size() && first_link < map.size() && old_map[first_link] == map[first_link])
+				++first_link;
+			if (0 < first_link)
+				--first_link;
+		}
 
-			for (;;) {
-				new_block = readFAT(block);
-				if (new_block <= 0)
-					break;
-				block = readFAT(block);
-			}
+		for (size_t i = first_link; i < links.size(); ++i) {
+			block_t next = i + 1 < links.size()? links[i + 1].first : FINAL;
+			if (links[i].second != 0)
+				next |= HOLE_FLAG;
+			writeFAT(next, links[i].first);
+		}
 
-			for (size_t i = 0; i < to_add; ++i) {
-				new_block = findFreeBlock();
-				if (new_block == -1) {
-					WARNS(RESIZEH, "Out of space " UDARR " " IDS("ENOSPC"));
-					EXIT;
-					return -ENOSPC;
-				}
+		for (; reused < old_markers.size(); ++reused) {
+			holeCounts.erase(old_markers[reused]);
+			writeFAT(0, old_markers[reused]);
+		}
 
-				DBGN(RESIZEH, IGS("Added") " block", new_block);
-				writeFAT(new_block, block);
-				writeFAT(FINAL, new_block);
-				block = new_block;
-				++added;
+		if (file.startBlock != map.front()) {
+			forgetBlockMap(file.startBlock);
+			file.startBlock = map.front();
+		}
+
+		blockMapSlot(file.startBlock) = std::move(map);
+		return 0;
+	}
+
+	int ThornFATDriver::zeroRange(const DirEntry &file, size_t start, size_t end) {
+		const size_t bs = superblock.blockSize;
+		const std::vector<block_t> &map = blockMap(file.startBlock);
+
+		// Holes and anything past the end of the chain already read as zeroes.
+		end = std::min(end, map.size() * bs);
+		if (end <= start)
+			return 0;
+
+		std::vector<char> zeros(std::min(end - start, size_t(64) * bs), 0);
+		while (start < end) {
+			if (map[start / bs] == HOLE) {
+				start = (start / bs + 1) * bs;
+				continue;
 			}
 
-			blocksFree -= added;
+			size_t stop = std::min(end, (start / bs + 1) * bs);
+			while (stop < end && stop - start < zeros.size() && map[stop / bs] != HOLE)
+				stop = std::min(end, stop + bs);
 
-			DBGF(RESIZEH, "Trying to change file" DARR "length at offset " BLR " from " BDR " to " BLR ".",
-				file_offset, file.length, new_size);
-			file.length = new_size;
-			writeEntry(file, file_offset);
+			const size_t chunk = std::min(zeros.size(), stop - start);
+			const ssize_t status = transfer(file.startBlock, start, zeros.data(), chunk, true);
+			SCHECK("zeroRange", "Couldn't zero out part of a file");
+			start += chunk;
 		}
 
-		SUCCS(RESIZEH, "Successfully resized.");
-		EXIT; return 0;
+		return 0;
 	}
 
 	int ThornFATDriver::zeroOutFree(const DirEntry &file, size_t new_size) {
@@ -945,7 +2143,7 @@ namespace ThornFAT {
 		ENTER;
 		DBGF(ZEROOUTFREEH, "Freeing space for file at block " BDR DS " size" DL " " BDR " " UDARR " " BDR,
 			file.startBlock, file.length, new_size);
-		uint32_t bs = superblock.blockSize;
+		const size_t bs = superblock.blockSize;
 
 		if (new_size % bs == 0) {
 			// There's nothing to do here.
@@ -953,61 +2151,141 @@ namespace ThornFAT {
 			return 0;
 		}
 
-		size_t diff = file.length - new_size;
 		if (file.length <= new_size) {
-			WARN(ZEROOUTFREEH, "New size isn't smaller than old size (diff = " BDR "); skipping.", diff);
+			WARN(ZEROOUTFREEH, "New size isn't smaller than old size (" BDR " <= " BDR "); skipping.", file.length,
+				new_size);
 			EXIT;
 			return 0;
 		}
 
-		uint32_t remaining = new_size;
-		block_t block = file.startBlock;
+		// Only the rest of the block that becomes the last one needs clearing. The blocks after it are about to be
+		// freed, and they aren't necessarily the physically next ones.
+		const int status = zeroRange(file, new_size, std::min<size_t>(file.length, updiv(new_size, bs) * bs));
+		SCHECKX(ZEROOUTFREEH, "zeroRange failed");
+
+		DBG(ZEROOUTFREEH, "Done.");
+		EXIT;
+		return 0;
+	}
+
+	block_t ThornFATDriver::findFreeBlock() {
+		if (!buildFreeMap())
+			return UNUSABLE;
+
+		if (blocksFree == 0)
+			return UNUSABLE;
+
+		// Start at the cursor and wrap around once. The cursor stays on the block found, so calling this again without
+		// allocating the block returns the same one, as the old scan from block 0 did.
+		const size_t word_count = freeMap.size();
+		const size_t start_word = freeCursor / 64;
+		for (size_t n = 0; n <= word_count; ++n) {
+			const size_t word_index = (start_word + n) % word_count;
+			const uint64_t word = freeMap[word_index];
+			if (word == 0)
+				continue;
+			for (size_t bit = 0; bit < 64; ++bit) {
+				if ((word & (1ul << bit)) == 0)
+					continue;
+				const size_t block = word_index * 64 + bit;
+				// On the first pass over the starting word, blocks before the cursor come last.
+				if (n == 0 && block < freeCursor)
+					continue;
+				freeCursor = block;
+				return block;
+			}
+		}
+
+		return UNUSABLE;
+	}
+
+	bool ThornFATDriver::blockFree(size_t block) const {
+		return block < superblock.blockCount && !freeMap.empty() && (freeMap[block / 64] & (1ul << (block % 64))) != 0;
+	}
+
+	int ThornFATDriver::allocateBlocks(size_t count, block_t preferred, std::vector<block_t> &out) {
+		out.clear();
+		if (count == 0)
+			return 0;
 
-		CHECKBLOCK(ZEROOUTFREEH, "Invalid block");
-		// lseek(imgfd, block * bs, SEEK_SET);
-		// ECHECKXC(ZEROOUTFREEH, "lseek() failed");
+		if (!buildFreeMap())
+			return -EIO;
 
-		size_t position = block * bs;
+		if (blocksFree < ssize_t(count))
+			return -ENOSPC;
+
+		out.reserve(count);
+		auto take_run = [&](size_t start, size_t length) {
+			for (size_t i = 0; i < length; ++i)
+				out.push_back(start + i);
+		};
 
-		DBGF(ZEROOUTFREEH, "bs = " BDR DM " remaining = " BUR, bs, remaining);
-		while (bs < remaining) {
-			DBGF(ZEROOUTFREEH, BDR " " UDARR " " BDR, block, readFAT(block));
-			block = readFAT(block);
-			CHECKBLOCK(ZEROOUTFREEH, "Invalid block in loop");
-			position = block * bs;
-			// lseek(imgfd, block * bs, SEEK_SET);
-			// ECHECKXC(ZEROOUTFREEH, "lseek() failed");
-			remaining -= bs;
+		// Best case: the blocks right after the end of the file are free, so the file stays in one piece.
+		if (0 < preferred) {
+			size_t length = 0;
+			while (length < count && blockFree(preferred + length))
+				++length;
+			if (length == count)
+				take_run(preferred, count);
 		}
 
-		position += remaining;
-		static char empty[1024] = {0};
-		ssize_t status;
-		while (sizeof(empty) <= diff) {
-			status = partition->write(empty, sizeof(empty), position);
-			SCHECK(ZEROOUTFREEH, "Writing to partition failed");
-			position += sizeof(empty);
-			diff -= sizeof(empty);
+		if (out.empty()) {
+			// Collect the free runs, remembering the smallest one that can hold everything.
+			std::vector<std::pair<size_t, size_t>> runs;
+			size_t best_start = 0, best_length = 0;
+			const size_t block_count = superblock.blockCount;
+			for (size_t block = 0; block < block_count;) {
+				if (freeMap[block / 64] == 0 && block % 64 == 0) {
+					block += 64;
+					continue;
+				}
+
+				if (!blockFree(block)) {
+					++block;
+					continue;
+				}
+
+				const size_t start = block;
+				while (block < block_count && blockFree(block))
+					++block;
+				const size_t length = block - start;
+				runs.emplace_back(start, length);
+				if (count <= length && (best_length == 0 || length < best_length)) {
+					best_start = start;
+					best_length = length;
+					if (length == count)
+						break;
+				}
+			}
+
+			if (best_length != 0) {
+				take_run(best_start, count);
+			} else {
+				// Nothing is big enough on its own, so use as few runs as possible: take the largest first.
+				std::sort(runs.begin(), runs.end(), [](const auto &left, const auto &right) {
+					return right.second < left.second;
+				});
+				for (const auto &[start, length]: runs) {
+					take_run(start, std::min(length, count - out.size()));
+					if (out.size() == count)
+						break;
+				}
+			}
 		}
 
-		if (0 < diff) {
-			status = partition->write(empty, diff, position);
-			SCHECK(ZEROOUTFREEH, "Writing to partition failed");
+		if (out.size() != count) {
+			out.clear();
+			return -ENOSPC;
 		}
 
-		DBG(ZEROOUTFREEH, "Done.");
-		EXIT;
+		// Link the whole chain while it's in the cache; the flush writes it out as one run per extent.
+		for (size_t i = 0; i + 1 < count; ++i)
+			writeFAT(out[i + 1], out[i]);
+		writeFAT(FINAL, out.back());
+		freeCursor = out.back() + 1 < superblock.blockCount? out.back() + 1 : 0;
 		return 0;
 	}
 
-	block_t ThornFATDriver::findFreeBlock() {
-		auto block_c = superblock.blockCount;
-		for (decltype(block_c) i = 0; i < block_c; ++i)
-			if (readFAT(i) == 0)
-				return i;
-		return UNUSABLE;
-	}
-
 	int ThornFATDriver::directoryEmpty(const DirEntry &dir) {
 		HELLO(dir.name.str);
 		if (!dir.isDirectory())
@@ -1016,25 +2294,27 @@ namespace ThornFAT {
 		if (dir.length == 0)
 			return 1;
 
-		std::vector<DirEntry> entries;
-		int status = readDir(dir, entries);
-		if (status < 0)
-			return status;
-
-		const size_t count = entries.size();
-		if (count <= 1)
+		if (dir.length <= entrySize())
 			return 1;
 
-		for (size_t i = 0; i < count; ++i) {
-			if (hasStuff(entries[i]))
-				return 0;
-		}
+		bool empty = true;
+		int status = iterateDir(dir, [&](const DirEntry &entry, off_t) {
+			if (hasStuff(entry)) {
+				empty = false;
+				return false;
+			}
+			return true;
+		});
+
+		if (status < 0)
+			return status;
 
-		return 1;
+		return empty? 1 : 0;
 	}
 
 	void ThornFATDriver::updateName(DirEntry &entry, const char *new_name) {
 		strncpy(entry.name.str, new_name, sizeof(entry.name.str));
+		entry.updateHash();
 	}
 
 	void ThornFATDriver::updateName(DirEntry &entry, const std::string &new_name) {
@@ -1042,6 +2322,14 @@ namespace ThornFAT {
 	}
 
 	block_t ThornFATDriver::readFAT(size_t block_offset) {
+		const block_t raw = rawFAT(block_offset);
+		return 0 < raw && (raw & HOLE_FLAG)? raw & ~HOLE_FLAG : raw;
+	}
+
+	block_t ThornFATDriver::rawFAT(size_t block_offset) {
+		if (const block_t *cached = cachedFAT(block_offset))
+			return *cached;
+
 		block_t out;
 		ssize_t status = partition->read(&out, sizeof(block_t), superblock.blockSize + block_offset * sizeof(block_t));
 		SCHECK("readFAT", "Reading failed");
@@ -1051,12 +2339,161 @@ namespace ThornFAT {
 	}
 
 	int ThornFATDriver::writeFAT(block_t block, size_t block_offset) {
+		if (block_t *cached = cachedFAT(block_offset)) {
+			if (*cached != block) {
+				if (!freeMap.empty() && block_offset < superblock.blockCount && (*cached == 0) != (block == 0)) {
+					// The entry is going from free to allocated or vice versa.
+					freeMap[block_offset / 64] ^= 1ul << (block_offset % 64);
+					blocksFree += block == 0? 1 : -1;
+				}
+				*cached = block;
+				FATChunk &chunk = fatCache[block_offset / FAT_CHUNK_SIZE];
+				const size_t index = block_offset % FAT_CHUNK_SIZE;
+				if (!chunk.dirty[index]) {
+					chunk.dirty[index] = true;
+					++chunk.dirtyCount;
+				}
+			}
+			return 0;
+		}
+
 		// DEBUG("writeFAT adjusted offset: %lu <- %d\n", superblock.blockSize + block_offset * sizeof(block_t), block);
 		ssize_t status = partition->write(&block, sizeof(block_t), superblock.blockSize + block_offset * sizeof(block_t));
 		SCHECK("writeFAT", "Writing failed");
 		return 0;
 	}
 
+	bool ThornFATDriver::holeMarker(block_t block) {
+		const block_t raw = rawFAT(block);
+		return 0 < raw && (raw & HOLE_FLAG);
+	}
+
+	uint64_t ThornFATDriver::holeCount(block_t block) {
+		auto iter = holeCounts.find(block);
+		if (iter != holeCounts.end())
+			return iter->second;
+
+		uint64_t count = 0;
+		if (partition->read(&count, sizeof(count), size_t(block) * superblock.blockSize) < 0 || count == 0) {
+			WARN("holeCount", "Couldn't read the hole marker at block " BDR, block);
+			return 0;
+		}
+
+		holeCounts.emplace(block, count);
+		return count;
+	}
+
+	size_t ThornFATDriver::fatEntries() const {
+		if (superblock.magic != MAGIC && superblock.magic != MAGIC_V2)
+			return 0;
+		return size_t(superblock.fatBlocks) * superblock.blockSize / sizeof(block_t);
+	}
+
+	block_t * ThornFATDriver::cachedFAT(size_t block_offset) {
+		const size_t entries = fatEntries();
+		if (entries <= block_offset)
+			return nullptr;
+
+		if (fatCache.empty()) {
+			fatCache.resize(updiv(entries, FAT_CHUNK_SIZE));
+			if (entries <= FAT_PRELOAD_MAX && loadFATChunks(0, fatCache.size()) != 0) {
+				fatCache.clear();
+				return nullptr;
+			}
+		}
+
+		const size_t chunk_index = block_offset / FAT_CHUNK_SIZE;
+		FATChunk &chunk = fatCache[chunk_index];
+		if (chunk.entries.empty() && loadFATChunks(chunk_index, 1) != 0)
+			return nullptr;
+
+		return &chunk.entries[block_offset % FAT_CHUNK_SIZE];
+	}
+
+	int ThornFATDriver::loadFATChunks(size_t first_chunk, size_t chunk_count) {
+		const size_t first_entry = first_chunk * FAT_CHUNK_SIZE;
+		const size_t entry_count = std::min((first_chunk + chunk_count) * FAT_CHUNK_SIZE, fatEntries()) - first_entry;
+
+		std::vector<block_t> buffer(entry_count);
+		const ssize_t status = partition->read(buffer.data(), entry_count * sizeof(block_t),
+			superblock.blockSize + first_entry * sizeof(block_t));
+		if (status < 0) {
+			DBGN("loadFATChunks", "Reading failed:", status);
+			return status;
+		}
+
+		for (size_t i = 0; i < chunk_count; ++i) {
+			FATChunk &chunk = fatCache[first_chunk + i];
+			const size_t begin = i * FAT_CHUNK_SIZE;
+			const size_t end = std::min(begin + FAT_CHUNK_SIZE, entry_count);
+			chunk.entries.assign(buffer.begin() + begin, buffer.begin() + end);
+			chunk.dirty.assign(end - begin, false);
+			chunk.dirtyCount = 0;
+		}
+
+		return 0;
+	}
+
+	int ThornFATDriver::flushFAT() {
+		// Runs of dirty entries can continue into the next chunk, so they're gathered into one buffer and written in a
+		// single request regardless of chunk boundaries.
+		std::vector<block_t> run;
+		size_t run_start = 0;
+
+		auto write_run = [&]() -> int {
+			if (run.empty())
+				return 0;
+
+			const ssize_t status = partition->write(run.data(), run.size() * sizeof(block_t),
+				superblock.blockSize + run_start * sizeof(block_t));
+			if (status < 0) {
+				// The entries stay marked so that a later flush can retry them.
+				DBGN("flushFAT", "Writing failed:", status);
+				return status;
+			}
+
+			for (size_t entry = run_start, end = run_start + run.size(); entry < end; ++entry) {
+				FATChunk &chunk = fatCache[entry / FAT_CHUNK_SIZE];
+				chunk.dirty[entry % FAT_CHUNK_SIZE] = false;
+				--chunk.dirtyCount;
+			}
+
+			run.clear();
+			return 0;
+		};
+
+		int status;
+		for (size_t chunk_index = 0, chunk_count = fatCache.size(); chunk_index < chunk_count; ++chunk_index) {
+			FATChunk &chunk = fatCache[chunk_index];
+			if (chunk.dirtyCount == 0) {
+				if ((status = write_run()) < 0)
+					return status;
+				continue;
+			}
+
+			for (size_t i = 0, size = chunk.entries.size(); i < size; ++i) {
+				if (chunk.dirty[i]) {
+					if (run.empty())
+						run_start = chunk_index * FAT_CHUNK_SIZE + i;
+					run.push_back(chunk.entries[i]);
+				} else if ((status = write_run()) < 0)
+					return status;
+			}
+		}
+
+		return write_run();
+	}
+
+	void ThornFATDriver::resetFATCache() {
+		fatCache.clear();
+		blockMaps.clear();
+		holeCounts.clear();
+		dirInfos.clear();
+		freeMap.clear();
+		blocksFree = -1;
+		freeCursor = 0;
+	}
+
 	bool ThornFATDriver::initFAT(size_t table_size, size_t block_size) {
 		DBGF("initFAT", "writeOffset = %lu, table_size = %lu", writeOffset, table_size);
 		DBGF("initFAT", "sizeof: Filename[%lu], Times[%lu], block_t[%lu], FileType[%lu], mode_t[%lu], DirEntry[%lu], "
@@ -1101,22 +2538,23 @@ namespace ThornFAT {
 	bool ThornFATDriver::initData(size_t table_size, size_t block_size) {
 		root.reset();
 		root.name.str[0] = '.';
-		root.length = 2 * sizeof(DirEntry);
+		root.length = 2 * entrySize();
 		root.startBlock = table_size + 1;
 		root.type = FileType::Directory;
 		writeOffset = block_size * root.startBlock;
 		ssize_t status;
 		DBGN("initData", "writeOffset:", writeOffset);
-		if ((status = write(root)) < 0) {
+		if ((status = storeEntry(root, writeOffset)) < 0) {
 			DBGN("initData", "Failed to write. Status:", status);
 			return false;
 		}
 		root.name.str[1] = '.';
-		if ((status = write(root)) < 0) {
+		if ((status = storeEntry(root, writeOffset + entrySize())) < 0) {
 			DBGN("initData", "Failed to write. Status:", status);
 			return false;
 		}
 		root.name.str[1] = '\0';
+		writeOffset += 2 * entrySize();
 		return true;
 	}
 
@@ -1125,23 +2563,43 @@ namespace ThornFAT {
 	}
 
 	bool ThornFATDriver::hasFree(const size_t count) {
-		size_t scanned = 0;
-		size_t block_c = superblock.blockCount;
-		for (size_t i = 0; i < block_c; ++i)
-			if (readFAT(i) == 0 && count <= ++scanned)
-				return true;
-		return false;
+		const ssize_t free_count = countFree();
+		return 0 <= free_count && count <= size_t(free_count);
 	}
 
 	ssize_t ThornFATDriver::countFree() {
-		if (0 <= blocksFree)
-			return blocksFree;
+		buildFreeMap();
+		return blocksFree;
+	}
+
+	bool ThornFATDriver::buildFreeMap() {
+		if (!freeMap.empty())
+			return true;
+
+		const size_t block_count = superblock.blockCount;
+		if (block_count == 0 || fatEntries() < block_count)
+			return false;
 
+		freeMap.assign(updiv(block_count, size_t(64)), 0);
 		blocksFree = 0;
-		for (int i = superblock.blockCount - 1; 0 <= i; --i)
-			if (readFAT(i) == 0)
+		freeCursor = 0;
+
+		// With the FAT cache in place, this is one sequential read of the table.
+		for (size_t i = 0; i < block_count; ++i) {
+			const block_t *entry = cachedFAT(i);
+			if (!entry) {
+				freeMap.clear();
+				blocksFree = -1;
+				return false;
+			}
+
+			if (*entry == 0) {
+				freeMap[i / 64] |= 1ul << (i % 64);
 				++blocksFree;
-		return blocksFree;
+			}
+		}
+
+		return true;
 	}
 
 	bool ThornFATDriver::checkBlock(block_t block) {
@@ -1154,7 +2612,15 @@ namespace ThornFAT {
 	}
 
 	bool ThornFATDriver::isFree(const DirEntry &entry) {
-		return entry.startBlock == 0 || readFAT(entry.startBlock) == 0;
+		// remove and rmdir zero the start block, so that's usually enough. The free map covers entries whose chain was
+		// freed without the entry being cleared, without costing a device read per entry.
+		if (entry.startBlock == 0)
+			return true;
+		if (entry.startBlock < 0 || superblock.blockCount <= size_t(entry.startBlock))
+			return false;
+		if (buildFreeMap())
+			return blockFree(entry.startBlock);
+		return readFAT(entry.startBlock) == 0;
 	}
 
 	bool ThornFATDriver::hasStuff(const DirEntry &entry) {
@@ -1199,7 +2665,10 @@ namespace ThornFAT {
 			// The offset of its directory entry will then be available for us to use.
 			// We don't have to worry about not having enough space in this case; in fact,
 			// we're actually freeing up at least one block.
+			// Compaction would move the entries whose offsets we're holding on to.
+			autoCompact = false;
 			status = remove(destpath);
+			autoCompact = true;
 			SCHECK(RENAMEH, "Couldn't unlink target");
 		} else if (status == -ENOENT) {
 			DBGFE(RENAMEH, IUS("Destination " BSR " doesn't exist."), destpath);
@@ -1222,18 +2691,43 @@ namespace ThornFAT {
 			return -EINVAL;
 		}
 
+		// Inline data lives right after the name, so it has to move along with it or out of the entry entirely.
+		const std::string inline_data = src_entry.isInline()?
+			std::string(src_entry.inlineData(), src_entry.length) : std::string();
 		memset(src_entry.name.str, 0, THORNFAT_PATH_MAX + 1);
 		strncpy(src_entry.name.str, destbase->c_str(), THORNFAT_PATH_MAX);
+		src_entry.updateHash();
+		if (src_entry.isInline()) {
+			if (src_entry.length <= inlineCapacity(src_entry)) {
+				memcpy(src_entry.inlineData(), inline_data.data(), src_entry.length);
+			} else {
+				status = spill(src_entry, inline_data.data());
+				SCHECK(RENAMEH, "Couldn't move inline data out of the entry");
+			}
+		}
 
 		// Once we've ensured the destination doesn't exist or no longer exists,
 		// we move the source's directory entry to the destination's offset.
-		status = partition->write(&src_entry, sizeof(DirEntry), dest_offset);
+		status = storeEntry(src_entry, dest_offset);
 		SCHECK(RENAMEH, "Writing failed");
 
 		// Now we need to remove the source entry's original directory entry from the disk image.
-		status = partition->write(nothing, sizeof(DirEntry), src_offset);
+		status = clearEntry(src_offset);
 		SCHECK(RENAMEH, "Writing failed");
 
+		// The entries were moved with raw writes, so the cache can't follow them.
+		clearDentries();
+		claimSlot(dest_offset);
+		releaseSlot(srcpath, src_offset);
+		DirEntry dest_parent;
+		if (0 <= find(-1, destpath, &dest_parent, nullptr, true))
+			indexInsert(dest_parent.startBlock, src_entry.name.str, dest_offset);
+		for (auto &[fd, open_file]: openFiles)
+			if (open_file.offset == src_offset) {
+				open_file.offset = dest_offset;
+				open_file.entry = src_entry;
+			}
+
 		SUCC(RENAMEH, "Moved " BSR " to " BSR ".", srcpath, destpath);
 		return 0;
 	}
@@ -1243,12 +2737,13 @@ namespace ThornFAT {
 	}
 
 	int ThornFATDriver::statfs(const char *, FS::DriverStats &stats) {
-		stats.magic = MAGIC;
+		stats.magic = superblock.magic;
 		stats.nameMax = THORNFAT_PATH_MAX;
 		stats.optimalBlockSize = superblock.blockSize;
 		stats.totalBlocks = superblock.blockCount;
-		// TODO: stats.freeBlocks
-		// TODO: stats.availableBlocks
+		const ssize_t free_count = countFree();
+		if (0 <= free_count)
+			stats.freeBlocks = stats.availableBlocks = free_count;
 		// TODO: stats.files
 		// TODO: stats.freeFiles
 		// TODO: stats.flags
@@ -1312,8 +2807,6 @@ namespace ThornFAT {
 		DBGL;
 		DBGF(WRITEH, PMETHOD("write") BSTR DMS "offset " BLR DMS "size " BLR, path, offset, size);
 
-		const size_t bs = superblock.blockSize;
-
 		DirEntry file;
 		off_t file_offset;
 
@@ -1322,87 +2815,41 @@ namespace ThornFAT {
 		SCHECK(WRITEH, "fat_find failed");
 		DBG2(WRITEH, "Found file:", file.name.str);
 
-		size_t length = file.length;
-		size_t new_size = offset + size > length? offset + size : length;
-		status = resize(file, file_offset, new_size);
-		SCHECK(WRITEH, "resize failed");
-
-		block_t block = file.startBlock;
-		DBGF(WRITEH, "Starting write with block offset " BLR ", file offset " BLR ".", block * bs, offset);
-
-		off_t offset_left = offset;
-		while (static_cast<off_t>(bs) <= offset_left) {
-			const block_t block_fat = readFAT(block);
-			if (block_fat != -2 && block_fat < 1) {
-				DBGN(WRITEH, "Next block is invalid:", block);
-			}
+		return writeData(file, file_offset, buffer, size, offset);
+	}
 
-			block = block_fat;
-			DBGF(WRITEH, "Skipping to block " BDR " " DARR " offset " BLR, block, block * bs);
-			offset_left -= bs;
-		}
-
-		CHECKBLOCK(WRITEH, "Invalid block");
-
-		size_t position = block * bs + offset_left;
-		ssize_t size_left = size;
-		ssize_t to_write;
-		ssize_t bytes_written = 0;
-		if (offset_left + size <= bs) {
-			// If the amount to write doesn't require us to move into other blocks, just finish everything here.
-			DBGF(WRITEH, "Performing " IPS("small write") " of size " BLR " to block " BDR " with " BLR
-				" remaining offset.", size, block, offset_left);
-			status = partition->write(buffer, size, position);
-			position += size;
-			SCHECK(WRITEH, "Couldn't write from buffer");
-			size_left = 0;
-			bytes_written += size;
-		} else if (0 < offset_left) {
-			// We'll need to write multiple blocks and we're currently not block-aligned, so let's fix that.
-			to_write = bs - offset_left;
-			DBGF(WRITEH, "Writing " BLR " block%s to block-align.", PLURALS(to_write));
-			status = partition->write(buffer, to_write, position);
-			CHECKSL0(WRITEH, "Couldn't write to block-align");
-			position += to_write;
-			DBGH(WRITEH, "Now at offset", block * bs + offset_left + to_write);
-			SCHECK(WRITEH, "Couldn't write from buffer");
-
-			block = readFAT(block);
-			const block_t block_fat = readFAT(block);
-			if (block_fat != FINAL && block_fat < 1)
-				DBGN(WRITEH, "Next block is invalid:", block);
-
-			CHECKBLOCK(WRITEH, "Invalid block during block alignment");
-			DBGN(WRITEH, "Jumping to block", block);
-			position = block * bs;
-			DBGH(WRITEH, "Now at offset", block * bs);
-
-			bytes_written += to_write;
-			size_left -= to_write;
-		}
-
-		while (0 < size_left) {
-			// Don't write more than one block at a time.
-			to_write = static_cast<ssize_t>(bs) < size_left? bs : size_left;
-
-			DBGF(WRITEH, "Writing to block " A_PINK BDR A_RESET " (to_write = " BLR DMS "position = " BULR ")",
-				block, to_write, position);
-			status = partition->write(buffer + bytes_written, to_write, position);
-			SCHECK(WRITEH, "Couldn't read into buffer");
-			position += to_write;
-
-			bytes_written += to_write;
-			size_left  -= to_write;
-			block = readFAT(block);
-			if (block == FINAL && size_left != 0) {
-				// We still have more to write, but this block was the last one.
-				WARNS(WRITEH, "There is still more to write, but there are no more blocks left!");
-				break;
-			} else if (block != FINAL) {
-				DBGF(WRITEH, "Next block" DL " " BDR DS " seeking to" DL " " BULR, block, block * bs);
-				CHECKBLOCK(WRITEH, "Invalid block while writing");
-				position = block * bs;
+	int ThornFATDriver::writeData(DirEntry &file, off_t file_offset, const char *buffer, size_t size, off_t offset) {
+		const size_t bs = superblock.blockSize;
+		int status;
+		if (file.isInline()) {
+			if (offset + size <= inlineCapacity(file)) {
+				memcpy(file.inlineData() + offset, buffer, size);
+				file.length = std::max<size_t>(file.length, offset + size);
+				writeEntry(file, file_offset);
+				SUCC(WRITEH, "Wrote " BLR " byte%s inline", PLURALS(size));
+				return size;
 			}
+
+			status = spill(file, file.inlineData());
+			SCHECK(WRITEH, "Couldn't move inline data out of the entry");
+		}
+
+		// Only the blocks the write touches get allocated; anything it skips over stays a hole.
+		status = allocateRange(file, offset, size);
+		if (status < 0) {
+			WARN(WRITEH, "Couldn't allocate space: " BDR, status);
+			// The chain may have changed already, so keep the entry consistent with it.
+			writeEntry(file, file_offset);
+			return status;
+		}
+
+		DBGF(WRITEH, "Starting write with block offset " BLR ", file offset " BLR ".", file.startBlock * bs, offset);
+		const ssize_t bytes_written = transfer(file.startBlock, offset, const_cast<char *>(buffer), size, true);
+		if (bytes_written < 0) {
+			WARN(WRITEH, "Couldn't write from buffer: " BLR, bytes_written);
+			// The chain has already grown, so keep the entry consistent with it.
+			writeEntry(file, file_offset);
+			return bytes_written;
 		}
 
 		// TODO: time syscall. Syscalls in general, really.
@@ -1426,7 +2873,7 @@ namespace ThornFAT {
 		off_t offset;
 
 		DBG(MKDIRH, "Creating new file for directory.");
-		int status = newFile(simplified.c_str(), sizeof(DirEntry), FileType::Directory, nullptr, &subdir, &offset,
+		int status = newFile(simplified.c_str(), entrySize(), FileType::Directory, nullptr, &subdir, &offset,
 		                     &parent, nullptr, false);
 		SCHECK(MKDIRH, "newFile failed");
 
@@ -1460,6 +2907,67 @@ namespace ThornFAT {
 		return 0;
 	}
 
+	int ThornFATDriver::fallocate(const char *path, off_t offset, off_t length) {
+		HELLO(path);
+		DBGF("fallocate", MMETHOD("fallocate") BSTR DM " offset " BLR DM " length " BLR, path, offset, length);
+		if (offset < 0 || length <= 0)
+			return -EINVAL;
+
+		DirEntry file;
+		off_t file_offset;
+		int status = find(-1, path, &file, &file_offset);
+		SCHECK("fallocate", "fat_find failed");
+
+		if (file.isDirectory())
+			return -EISDIR;
+
+		// The range can't reach past what the whole volume could hold, and checking that first keeps the sum below
+		// from wrapping around.
+		const size_t capacity = superblock.blockCount * superblock.blockSize;
+		if (capacity < size_t(offset) || capacity - size_t(offset) < size_t(length))
+			return -EFBIG;
+
+		const size_t end = size_t(offset) + size_t(length);
+		if (file.isInline()) {
+			// The entry already has room for the whole range.
+			if (end <= inlineCapacity(file))
+				return 0;
+
+			status = spill(file, file.inlineData());
+			SCHECK("fallocate", "Couldn't move inline data out of the entry");
+		}
+
+		const size_t bs = superblock.blockSize;
+		std::vector<std::pair<size_t, block_t>> added;
+		status = fillBlocks(file, offset / bs, (end - 1) / bs, added);
+
+		// Holes within the file have to keep reading as zeroes. Blocks past the end can be left as they are, since
+		// whatever extends the file clears the space it exposes.
+		constexpr size_t BATCH = 64;
+		std::vector<char> zeros;
+		for (size_t i = 0; 0 <= status && i < added.size() && added[i].first * bs < file.length;) {
+			size_t run = 1;
+			while (i + run < added.size() && run < BATCH && added[i + run].first == added[i].first + run &&
+			       added[i + run].second == added[i].second + block_t(run))
+				++run;
+
+			const size_t bytes = std::min(run * bs, file.length - added[i].first * bs);
+			if (zeros.size() < bytes)
+				zeros.resize(bytes, 0);
+			const ssize_t written = partition->write(zeros.data(), bytes, size_t(added[i].second) * bs);
+			if (written < 0)
+				status = written;
+			i += run;
+		}
+
+		// The entry is saved even if something above failed. A spilled inline file's new block and any blocks that
+		// fillBlocks linked in are only reachable through it.
+		const int write_status = writeEntry(file, file_offset);
+		if (write_status < 0)
+			WARN("fallocate", "Couldn't update the entry: " BDR, write_status);
+		return status < 0? status : write_status;
+	}
+
 	int ThornFATDriver::rmdir(const char *path, bool recursive) {
 		HELLO(path);
 		DBGL;
@@ -1487,7 +2995,8 @@ namespace ThornFAT {
 			const size_t count = entries.size();
 			if (recursive) {
 				for (size_t i = 0; i < count; ++i) {
-					if (strcmp(entries[i].name.str, ".") == 0 || strcmp(entries[i].name.str, "..") == 0)
+					if (isFree(entries[i]) || strcmp(entries[i].name.str, ".") == 0 ||
+					    strcmp(entries[i].name.str, "..") == 0)
 						continue;
 					const std::string new_path = std::string(path) + "/" + entries[i].name.str;
 					status = entries[i].isDirectory()? rmdir(new_path.c_str(), true) : unlink(new_path.c_str());
@@ -1508,6 +3017,8 @@ namespace ThornFAT {
 		found.startBlock = 0;
 		found.length = 0;
 		writeEntry(found, offset);
+		releaseSlot(path, offset);
+		maybeCompact(path);
 
 		DBG(RMDIRH, "Done.");
 		return 0;
@@ -1525,14 +3036,62 @@ namespace ThornFAT {
 		return 0;
 	}
 
-	int ThornFATDriver::open(const char *) {
-		Kernel::panic("ThornFATDriver::open is unimplemented!");
+	int ThornFATDriver::open(const char *path) {
+		HELLO(path);
+		DirEntry found;
+		off_t offset;
+		int status = find(-1, FS::simplifyPath(path).c_str(), &found, &offset);
+		SCHECK("open", "find failed");
+
+		if (FD_MAX <= openFiles.size())
+			return -EMFILE;
+
+		// Reuse the lowest free descriptor.
+		fd_t fd = 0;
+		for (const auto &[used, open_file]: openFiles) {
+			if (used != fd)
+				break;
+			++fd;
+		}
+
+		openFiles.try_emplace(fd, OpenFile {found, offset});
+		return fd;
+	}
+
+	int ThornFATDriver::releaseFd(fd_t fd) {
+		return openFiles.erase(fd) == 0? -EBADF : 0;
+	}
+
+	int ThornFATDriver::readFd(fd_t fd, void *buffer, size_t size, off_t offset) {
+		auto iter = openFiles.find(fd);
+		if (iter == openFiles.end())
+			return -EBADF;
+		OpenFile &open_file = iter->second;
+		if (open_file.entry.startBlock == 0)
+			return -ENOENT;
+		return readData(open_file.entry, open_file.offset, buffer, size, offset);
+	}
+
+	int ThornFATDriver::writeFd(fd_t fd, const char *buffer, size_t size, off_t offset) {
+		auto iter = openFiles.find(fd);
+		if (iter == openFiles.end())
+			return -EBADF;
+		OpenFile &open_file = iter->second;
+		if (open_file.entry.startBlock == 0)
+			return -ENOENT;
+		return writeData(open_file.entry, open_file.offset, buffer, size, offset);
+	}
+
+	int ThornFATDriver::getsizeFd(fd_t fd, size_t &out) {
+		auto iter = openFiles.find(fd);
+		if (iter == openFiles.end())
+			return -EBADF;
+		out = iter->second.entry.length;
 		return 0;
 	}
 
 	int ThornFATDriver::read(const char *path, void *buffer, size_t size, off_t offset) {
 		HELLO(path);
-		const size_t bs = superblock.blockSize;
 
 		DBGL;
 		DBGF(READH, OMETHOD("read") BSTR DM " offset " BLR DM " size " BLR, path, offset, size);
@@ -1543,6 +3102,10 @@ namespace ThornFAT {
 		ssize_t status = find(-1, path, &file, &file_offset);
 		SCHECK(READH, "fat_find failed");
 
+		return readData(file, file_offset, buffer, size, offset);
+	}
+
+	int ThornFATDriver::readData(DirEntry &file, off_t, void *buffer, size_t size, off_t offset) {
 		size_t length = file.length;
 		if (length == 0 && file.isDirectory()) {
 			// This should already be prevented by fat_find().
@@ -1557,84 +3120,24 @@ namespace ThornFAT {
 			return 0;
 		}
 
-		block_t block = file.startBlock;
-		size_t bytes_read = 0;
-		size_t size_left = size;
-		size_t to_read;
-
-		off_t offset_left = offset;
-		while (static_cast<off_t>(bs) <= offset_left) {
-			const block_t block_fat = readFAT(block);
-			if (block_fat != -2 && block_fat < 1) {
-				DBGF(READH, "Next block is invalid (" BDR ")" SUDARR IDS("EINVAL"), block);
-				return -EINVAL;
-			}
-
-			block = block_fat;
-			offset_left -= bs;
-		}
-
-		// Seek to the block containing the relevant offset plus the remainder of the offset.
-		CHECKBLOCK(READH, "Invalid block");
-		size_t position = block * bs + offset_left;
-		DBGN(READH, "Seek:", block * bs + offset_left);
-
-		if (offset_left + size <= bs) {
-			// If the amount to read doesn't require us to move into other blocks, just finish everything here.
-			DBGN(READH, "Performing \e[36msmall read\e[36m from block", block);
-			DBGN(READH, "Offset left:", offset_left);
-			DBGN(READH, "Size:", size);
-			status = partition->read(buffer, size, position);
-			SCHECK(READH, "Couldn't read into buffer:");
-			position += size;
-			size_left = 0;
-			bytes_read += size;
-		} else if (0 < offset_left) {
-			// We'll need to read multiple blocks and we're currently not block-aligned, so let's fix that.
-			to_read = bs - offset_left;
-			status = partition->read(buffer, to_read, position);
-			SCHECK(READH, "Couldn't read into buffer:");
-			position += to_read;
-			bytes_read += to_read;
-			size_left -= to_read;
-		}
-
-		while (0 < size_left) {
-			// Don't read more than one block at a time.
-			to_read = bs < size_left? bs : size_left;
-
-			DBGN(READH, "Reading from block:\e[36m", block);
-			// status = read(imgfd, buf + bytes_read, to_read);
-			status = partition->read(static_cast<char *>(buffer) + bytes_read, to_read, position);
-			SCHECK(READH, "Couldn't read into buffer:");
-
-			position += to_read;
-			bytes_read += to_read;
-			size_left  -= to_read;
-
-			if (size_left == 0)
-				break;
-
-			block = readFAT(block);
-			if (block == -2 && size_left != 0) {
-				// We still have more to read, but this block was the last one. That's not good.
-				// Log a warning and break out of the loop. This won't happen unless the code is
-				// bad or the disk image is corrupted.
-				WARNS(READH, "There is still more to read, but there are no more blocks left!");
-				break;
-			}
-
-			DBGF(READH, "Next block: " BDR "; size left: " BLR, block, size_left);
-			if (block != FINAL)
-				position = block * bs;
+		// Reads are clamped to the end of the file. A whole-file read goes straight into the caller's buffer as one
+		// device request per extent.
+		if (length - offset < size)
+			size = length - offset;
+
+		ssize_t bytes_read;
+		if (file.isInline()) {
+			// The data came along with the entry, so there's nothing left to read from the device.
+			memcpy(buffer, file.inlineData() + offset, size);
+			bytes_read = size;
+		} else
+			bytes_read = transfer(file.startBlock, offset, buffer, size, false);
+
+		if (bytes_read < 0) {
+			WARN(READH, "Couldn't read into buffer: " BLR, bytes_read);
+			return bytes_read;
 		}
 
-		// TODO: time syscall.
-		// file.times.accessed = NOW;
-		DBGN(READH, "Writing new access time to entry:", file.times.accessed);
-		status = writeEntry(file, file_offset);
-		SCHECK(READH, "fat_write_entry (update accessed) status");
-
 		// Return the number of bytes we read into the buffer.
 		DBGN(READH, "Done.", bytes_read);
 		return bytes_read;
@@ -1667,42 +3170,32 @@ namespace ThornFAT {
 
 		DBGF(READDIRH, "Found directory at offset " BLR ": " BSR, file_offset, std::string(found).c_str());
 
-		std::vector<DirEntry> entries;
-		std::vector<off_t> offsets;
-
-		status = readDir(found, entries, &offsets);
-		SCHECK(READDIRH, "readDir failed");
-		const size_t count = entries.size();
-		DBGF(READDIRH, "Count: " BULR, count);
+		DBGF(READDIRH, "Count: " BULR, found.length / entrySize());
 
 		size_t excluded = 0;
 #ifdef READDIR_MAX_INCLUDE
 		size_t included = 0;
-		int last_index = -1;
 #endif
 
-		for (size_t i = 0; i < count; ++i) {
-			const DirEntry &entry = entries[i];
+		status = iterateDir(found, [&](const DirEntry &entry, off_t entry_offset) {
 			DBGF(READDIRH, "[] %s: %s", isFree(entry)? "free" : "not free", std::string(entry).c_str());
-			if (!isFree(entry)) {
-				filler(entry.name.str, offsets[i]);
+			if (!isFree(entry) && !isHidden(entry)) {
+				filler(entry.name.str, entry_offset);
 #ifdef READDIR_MAX_INCLUDE
-				last_index = i;
 				if (++included < READDIR_MAX_INCLUDE)
-					DBGF(READDIRH, "Including entry %s at offset %ld.", entry.name.str, offsets[i]);
+					DBGF(READDIRH, "Including entry %s at offset %ld.", entry.name.str, entry_offset);
 #else
-				DBGF(READDIRH, "Including entry %s at offset %ld.", entry.name.str, offsets[i]);
+				DBGF(READDIRH, "Including entry %s at offset %ld.", entry.name.str, entry_offset);
 #endif
 			} else
 				++excluded;
-		}
+			return true;
+		});
+		SCHECK(READDIRH, "iterateDir failed");
 
 #ifdef READDIR_MAX_INCLUDE
 		if (READDIR_MAX_INCLUDE < included)
-			DBGF(READDIRH, "... " BULR " more", count - READDIR_MAX_INCLUDE);
-
-		if (READDIR_MAX_INCLUDE <= included)
-			DBGF(READDIRH, "Including entry %s at offset %ld.", entries[last_index].name.str, offsets[last_index]);
+			DBGF(READDIRH, "... " BULR " more", included - READDIR_MAX_INCLUDE);
 #endif
 
 		if (0 < excluded) {
@@ -1749,22 +3242,36 @@ namespace ThornFAT {
 		return find(-1, path, &found);
 	}
 
-	bool ThornFATDriver::make(uint32_t block_size) {
+	bool ThornFATDriver::make(uint32_t block_size, bool dir_index, bool compact) {
 		const size_t block_count = partition->length / block_size;
+		compactEntries = compact;
+		nameSlots.clear();
+		nameBlockUsage.clear();
 
 		if (block_count < MINBLOCKS) {
 			DBGF("make", "Number of blocks for partition is too small: %lu", block_count);
 			return false;
 		}
 
-		if (block_size % sizeof(DirEntry)) {
+		if (size_t(HOLE_FLAG) <= block_count) {
+			// Block numbers have to stay clear of the bit that marks holes in the FAT.
+			DBGF("make", "Number of blocks for partition is too large: %lu", block_count);
+			return false;
+		}
+
+		if (block_size % entrySize()) {
 			// The block size must be a multiple of the size of a directory entry because it must be possible to fill a
 			// block with directory entries without any space left over.
-			DBGF("make", "Block size isn't a multiple of %lu.", sizeof(DirEntry));
+			DBGF("make", "Block size isn't a multiple of %lu.", entrySize());
+			return false;
+		}
+
+		if (compactEntries && block_size < NAME_UNIT * (1 + updiv(THORNFAT_PATH_MAX, NAME_UNIT))) {
+			DBG("make", "Block size must be able to hold a long filename.");
 			return false;
 		}
 
-		if (block_size < 2 * sizeof(DirEntry)) {
+		if (block_size < 2 * entrySize()) {
 			DBG("make", "Block size must be able to hold at least two directory entries.");
 			return false;
 		}
@@ -1782,13 +3289,18 @@ namespace ThornFAT {
 		}
 
 		superblock = {
-			.magic = MAGIC,
+			.magic = compactEntries? MAGIC_V2 : MAGIC,
 			.blockCount = block_count,
 			.fatBlocks = static_cast<uint32_t>(table_size),
 			.blockSize = block_size,
 			.startBlock = static_cast<block_t>(table_size + 1)
 		};
 
+		// initFAT writes the new table straight to disk, so anything cached from the old one is meaningless.
+		resetFATCache();
+		clearDentries();
+		indexChecked = false;
+		indexOffset = -1;
 		writeOffset = 0;
 		if (write(superblock) < 0)
 			return false;
@@ -1796,10 +3308,26 @@ namespace ThornFAT {
 			return false;
 		if (!initData(table_size, block_size))
 			return false;
-		return true;
+		// createIndex allocates through the FAT cache, so whatever it managed to do has to be flushed even if it failed.
+		const bool indexed = !dir_index || createIndex();
+		return sync() == 0 && indexed;
+	}
+
+	int ThornFATDriver::sync() {
+		if (indexHeaderDirty && 0 <= indexOffset) {
+			const ssize_t written = transfer(indexEntry.startBlock, 0, &indexHeader, sizeof(IndexHeader), true);
+			if (written < 0)
+				return written;
+			indexHeaderDirty = false;
+		}
+
+		return flushFAT();
 	}
 
 	bool ThornFATDriver::verify() {
-		return readSuperblock(superblock)? false : (superblock.magic == MAGIC);
+		if (readSuperblock(superblock))
+			return false;
+		compactEntries = superblock.magic == MAGIC_V2;
+		return superblock.magic == MAGIC || compactEntries;
 	}
 }
@@ -17,59 +17,29 @@ namespace Wasmc {
 	}
 
 	AnyBase * BinaryParser::parse(const Long instruction) {
-		auto get = [&](int offset, int length) -> Long {
-			return (instruction >> (64 - offset - length)) & ((1 << length) - 1);
-		};
-
-		const auto opcode = static_cast<Opcode>(get(0, 12));
-
-		if (opcode == 0)
-			return new AnyBase(0, 0, 0, 0);
-
-		if (RTYPES.count(opcode) != 0) {
-			const auto rs = get(19, 7);
-			const auto rt = get(12, 7);
-			const auto rd = get(26, 7);
-			const auto function = get(52, 12);
-			const auto condition = get(46, 4);
-			const auto flags = get(50, 2);
-			return new AnyR(opcode, rs, rt, rd, function, condition, flags);
+		const Opcode opcode = getOpcode(instruction);
+
+		switch (OPCODE_CLASSES[opcode]) {
+			case OpcodeClass::Nop:
+				return new AnyBase(0, 0, 0, 0);
+			case OpcodeClass::R:
+				return new AnyR(opcode, RField::Rs.extract(instruction), RField::Rt.extract(instruction),
+					RField::Rd.extract(instruction), RField::Funct.extract(instruction),
+					RField::Condition.extract(instruction), RField::Flags.extract(instruction));
+			case OpcodeClass::I:
+				return new AnyI(opcode, IField::Rs.extract(instruction), IField::Rd.extract(instruction),
+					IField::Immediate.extract(instruction), IField::Condition.extract(instruction),
+					IField::Flags.extract(instruction));
+			case OpcodeClass::J:
+				return new AnyJ(opcode, JField::Rs.extract(instruction), JField::Link.extract(instruction),
+					JField::Immediate.extract(instruction), JField::Condition.extract(instruction),
+					JField::Flags.extract(instruction));
+			default:
+				Kernel::panicf("Invalid instruction (opcode 0x%x): 0x%016lx", opcode, instruction);
 		}
-		
-		if (ITYPES.count(opcode) != 0) {
-			const auto rs = get(18, 7);
-			const auto rd = get(25, 7);
-			const auto immediate = instruction & 0xffffffff;
-			const auto condition = get(12, 4);
-			const auto flags = get(16, 2);
-			return new AnyI(opcode, rs, rd, immediate, condition, flags);
-		}
-
-		if (JTYPES.count(opcode) != 0) {
-			const auto rs = get(12, 7);
-			const auto link = get(19, 1);
-			const auto address = instruction & 0xffffffff;
-			const auto condition = get(26, 4);
-			const auto flags = get(30, 2);
-			return new AnyJ(opcode, rs, link, address, condition, flags);
-		}
-
-		strprint("R:\n");
-		for (const Opcode opc: RTYPES)
-			printf("- %u\n", opc);
-
-		strprint("I:\n");
-		for (const Opcode opc: ITYPES)
-			printf("- %u\n", opc);
-
-		strprint("J:\n");
-		for (const Opcode opc: JTYPES)
-			printf("- %u\n", opc);
-
-		Kernel::panicf("Invalid instruction (opcode 0x%x): 0x%016lx", opcode, instruction);
 	}
 
-	void BinaryParser::parse() {
+	void BinaryParser::parse(Mode mode) {
 		offsets = {
 			getCodeOffset(), getDataOffset(), getSymbolTableOffset(), getDebugOffset(), getRelocationOffset(),
 			getEndOffset()
@@ -99,80 +69,103 @@ namespace Wasmc {
 		author = nva_string.substr(second + 1, third - second - 1);
 
 		rawSymbols = slice(offsets.symbolTable / 8, offsets.debug / 8);
-		extractSymbols();
+		extractSymbols(mode != Mode::Load);
 
+		// Loading only needs the encoded instructions, and relocation patches rawCode directly.
 		rawCode = slice(offsets.code / 8, offsets.data / 8);
-		for (const Long instruction: rawCode)
-			code.emplace_back(parse(instruction));
+		code.clear();
+		if (mode == Mode::Full) {
+			code.reserve(rawCode.size());
+			for (const Long instruction: rawCode)
+				code.emplace_back(parse(instruction));
+		}
 
 		rawData = slice(offsets.data / 8, offsets.symbolTable / 8);
 
 		rawDebugData = slice(offsets.debug / 8, offsets.relocation / 8);
-		debugData = getDebugData();
+		debugData.clear();
+		if (mode == Mode::Full)
+			debugData = getDebugData();
 
 		rawRelocation = slice(offsets.relocation / 8, offsets.end / 8);
 		relocationData = getRelocationData();
 	}
 
-	void BinaryParser::applyRelocation(size_t code_offset, size_t data_offset) {
-		std::vector<uint8_t> data_bytes;
-		bool code_changed = false, data_changed = false;
-
+	void BinaryParser::applyRelocation(size_t code_offset, size_t data_offset, const Resolver &resolver) {
 		for (const RelocationData &relocation: relocationData) {
 			if (relocation.symbolIndex < 0 || long(symbols.size()) <= relocation.symbolIndex)
 				Kernel::panicf("Couldn't find symbol at index %ld\n", relocation.symbolIndex);
 
 			const SymbolTableEntry &symbol = symbols.at(relocation.symbolIndex);
 			long address = symbol.address;
-			if (symbol.type == SymbolEnum::Data)
+			if (resolver && isUnknown(symbol.type))
+				address = resolver(relocation.symbolIndex);
+			else if (symbol.type == SymbolEnum::Data)
 				address = address + data_offset;
 			else
 				address = address + code_offset;
 
 			if (relocation.isData) {
-				if (!data_changed) {
-					for (Long data: rawData)
-						for (int i = 0; i < 8; ++i)
-							data_bytes.push_back((data >> (8 * i)) & 0xff);
-					data_changed = true;
-				}
+				bool patched = false;
 				switch (relocation.type) {
 					case RelocationType::Upper4:
-						*(uint32_t *) &data_bytes[relocation.sectionOffset] = address >> 32;
+						patched = patchBytes(rawData, relocation.sectionOffset, Long(address) >> 32, 4);
 						break;
 					case RelocationType::Lower4:
-						*(uint32_t *) &data_bytes[relocation.sectionOffset] = address & 0xffffffff;
+						patched = patchBytes(rawData, relocation.sectionOffset, address & 0xffffffff, 4);
 						break;
 					case RelocationType::Full:
-						*(uint64_t *) &data_bytes[relocation.sectionOffset] = address;
+						patched = patchBytes(rawData, relocation.sectionOffset, address, 8);
+						break;
 					default:
 						Kernel::panicf("Invalid RelocationType: %d\n", relocation.type);
 				}
+
+				if (!patched)
+					Kernel::panicf("Data relocation at %ld is out of bounds\n", relocation.sectionOffset);
 			} else {
 				if (relocation.type == RelocationType::Upper4)
 					address >>= 32;
 				else if (relocation.type == RelocationType::Lower4)
 					address &= 0xffffffff;
-				if (AnyImmediate *any_imm = dynamic_cast<AnyImmediate *>(code.at(relocation.sectionOffset / 8).get())) {
-					any_imm->immediate = address;
-					code_changed = true;
-				} else
+				const size_t index = relocation.sectionOffset / 8;
+				if (rawCode.size() <= index || !patchImmediate(rawCode[index], address))
 					Kernel::panicf("No immediate value in instruction at %ld\n",
 						relocation.sectionOffset + offsets.code);
+				// Keep the decoded copy from a Full parse in sync.
+				if (index < code.size())
+					code[index].reset(parse(rawCode[index]));
 			}
 		}
+	}
 
-		if (code_changed) {
-			rawCode.clear();
-			for (const auto &instruction: code)
-				rawCode.push_back(instruction->encode());
+	bool BinaryParser::patchBytes(std::vector<Long> &words, size_t byte_offset, Long value, size_t width) {
+		if (words.size() * 8 < byte_offset + width)
+			return false;
+
+		const size_t shift = 8 * (byte_offset % 8);
+		Long &first = words[byte_offset / 8];
+		const Long mask = width == 8? ~0ul : (1ul << (8 * width)) - 1;
+
+		// Little-endian: the value's low bytes go into the first word, and anything that doesn't fit spills into
+		// the low bytes of the next one.
+		first = (first & ~(mask << shift)) | ((value & mask) << shift);
+		if (8 < shift / 8 + width) {
+			const size_t spilled = 64 - shift;
+			Long &second = words[byte_offset / 8 + 1];
+			second = (second & ~(mask >> spilled)) | ((value & mask) >> spilled);
 		}
 
-		if (data_changed) {
-			rawData.clear();
-			for (size_t i = 0, max = data_bytes.size(); i < max; i += 8)
-				rawData.push_back(*(uint64_t *) &data_bytes[i]);
-		}
+		return true;
+	}
+
+	bool BinaryParser::patchImmediate(Long &instruction, Long value) {
+		static_assert(IField::Immediate == JField::Immediate);
+		const OpcodeClass opcode_class = OPCODE_CLASSES[getOpcode(instruction)];
+		if (opcode_class != OpcodeClass::I && opcode_class != OpcodeClass::J)
+			return false;
+		instruction = (instruction & ~IField::Immediate.mask()) | IField::Immediate.insert(value);
+		return true;
 	}
 
 	decltype(BinaryParser::debugData) BinaryParser::copyDebugData() const {
@@ -246,23 +239,36 @@ namespace Wasmc {
 		return out;
 	}
 
-	void BinaryParser::extractSymbols() {
-		symbols.clear();
+	void BinaryParser::extractSymbols(bool with_labels) {
 		symbolIndices.clear();
+		symbols = readSymbols(raw.data(), getSymbolTableOffset() / 8, getDebugOffset() / 8, with_labels);
+		if (with_labels)
+			for (size_t i = 0, max = symbols.size(); i < max; ++i)
+				symbolIndices.try_emplace(symbols[i].label, i);
+	}
 
-		const size_t end = getDebugOffset() / 8;
-
-		for (size_t i = getSymbolTableOffset() / 8, j = 0; i < end && j < 1'000'000; ++j) {
-			const uint32_t id = raw[i] >> 32;
-			const short length = raw[i] & 0xffff;
-			const SymbolEnum type = static_cast<SymbolEnum>((raw[i] >> 16) & 0xffff);
-			const Long address = raw[i + 1];
+	std::vector<SymbolTableEntry> BinaryParser::readSymbols(const Long *words, size_t begin, size_t end,
+	                                                        bool with_labels) {
+		std::vector<SymbolTableEntry> out;
+
+		for (size_t i = begin, j = 0; i < end && j < 1'000'000; ++j) {
+			const uint32_t id = words[i] >> 32;
+			const short length = words[i] & 0xffff;
+			const SymbolEnum type = static_cast<SymbolEnum>((words[i] >> 16) & 0xffff);
+			const Long address = words[i + 1];
+
+			if (!with_labels) {
+				// Relocation refers to symbols by index, so the address and type are all that's needed.
+				out.emplace_back(id, address, type);
+				i += 2 + length;
+				continue;
+			}
 
 			std::string symbol_name;
 			symbol_name.reserve(8ul * length);
 
 			for (size_t index = i + 2; index < i + 2 + length; ++index) {
-				Long piece = raw[index];
+				Long piece = words[index];
 				size_t removed = 0;
 				// Take the next long and ignore any null bytes at the least significant end.
 				while (piece && (piece & 0xff) == 0) {
@@ -278,10 +284,11 @@ namespace Wasmc {
 				}
 			}
 
-			symbolIndices.try_emplace(symbol_name, symbols.size());
-			symbols.emplace_back(id, symbol_name, address, type);
+			out.emplace_back(id, symbol_name, address, type);
 			i += 2 + length;
 		}
+
+		return out;
 	}
 
 	std::vector<std::shared_ptr<DebugEntry>> BinaryParser::getDebugData() const {
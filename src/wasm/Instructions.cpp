@@ -1,7 +1,7 @@
 #include "wasm/Instructions.h"
 
 namespace Wasmc {
-	std::set<Opcode> RTYPES {
+	static constexpr Opcode R_OPCODES[] {
 		0b000000000001, // Math
 		0b000000000010, // Logic
 		0b000000001100, // Move From HI Register, Move From LO Register
@@ -17,7 +17,7 @@ namespace Wasmc {
 		0b000001000010, // Disable/Enable Interrupts
 	};
 
-	std::set<Opcode> ITYPES {
+	static constexpr Opcode I_OPCODES[] {
 		0b000000000011, // Add Immediate
 		0b000000000100, // Subtract Immediate
 		0b000000000101, // Multiply Immediate
@@ -68,216 +68,27 @@ namespace Wasmc {
 		0b000001000011, // Modulo Unsigned Immediate
 	};
 
-	std::set<Opcode> JTYPES {
+	static constexpr Opcode J_OPCODES[] {
 		0b000000001111, // Jump
 		0b000000010000, // Jump Conditional
 	};
 
-	std::map<std::string, Opcode> OPCODES {
-		{"nop",    0b000000000000},
-		{"add",    0b000000000001},
-		{"sll",    0b000000000001},
-		{"srl",    0b000000000001},
-		{"sra",    0b000000000001},
-		{"sub",    0b000000000001},
-		{"mult",   0b000000000001},
-		{"multu",  0b000000000001},
-		{"mod",    0b000000000001},
-		{"div",    0b000000000001},
-		{"divu",   0b000000000001},
-		{"modu",   0b000000000001},
-		{"sext32", 0b000000000001},
-		{"sext16", 0b000000000001},
-		{"sext8",  0b000000000001},
-		{"and",    0b000000000010},
-		{"nand",   0b000000000010},
-		{"nor",    0b000000000010},
-		{"not",    0b000000000010},
-		{"or",     0b000000000010},
-		{"xnor",   0b000000000010},
-		{"xor",    0b000000000010},
-		{"land",   0b000000000010},
-		{"lnand",  0b000000000010},
-		{"lnor",   0b000000000010},
-		{"lnot",   0b000000000010},
-		{"lor",    0b000000000010},
-		{"lxnor",  0b000000000010},
-		{"lxor",   0b000000000010},
-		{"addi",   0b000000000011},
-		{"subi",   0b000000000100},
-		{"multi",  0b000000000101},
-		{"andi",   0b000000000110},
-		{"nandi",  0b000000000111},
-		{"nori",   0b000000001000},
-		{"ori",    0b000000001001},
-		{"xnori",  0b000000001010},
-		{"xori",   0b000000001011},
-		{"lui",    0b000000001101},
-		{"sl",     0b000000001110},
-		{"sle",    0b000000001110},
-		{"seq",    0b000000001110},
-		{"slu",    0b000000001110},
-		{"sleu",   0b000000001110},
-		{"cmp",    0b000000001110},
-		{"j",      0b000000001111},
-		{"jc",     0b000000010000},
-		{"jr",     0b000000010001},
-		{"jrc",    0b000000010001},
-		{"jrl",    0b000000010001},
-		{"jrlc",   0b000000010001},
-		{"c",      0b000000010010},
-		{"cb",     0b000000010010},
-		{"ch",     0b000000010010},
-		{"l",      0b000000010010},
-		{"lb",     0b000000010010},
-		{"lh",     0b000000010010},
-		{"s",      0b000000010010},
-		{"sb",     0b000000010010},
-		{"sh",     0b000000010010},
-		{"spush",  0b000000010010},
-		{"spop",   0b000000010010},
-		{"ms",     0b000000010010},
-		{"cs",     0b000000010010},
-		{"ls",     0b000000010010},
-		{"ss",     0b000000010010},
-		{"li",     0b000000010011},
-		{"si",     0b000000010100},
-		{"set",    0b000000010101},
-		{"multui", 0b000000011000},
-		{"sli",    0b000000011001},
-		{"slei",   0b000000011010},
-		{"seqi",   0b000000011011},
-		{"slui",   0b000000011100},
-		{"sleui",  0b000000011101},
-		{"modi",   0b000000011110},
-		{"ext",    0b000000011111},
-		{"int",    0b000000100000},
-		{"rit",    0b000000100001},
-		{"slli",   0b000000100010},
-		{"srli",   0b000000100011},
-		{"srai",   0b000000100100},
-		{"lbi",    0b000000100101},
-		{"sbi",    0b000000100110},
-		{"lni",    0b000000100111},
-		{"lbni",   0b000000101000},
-		{"sgi",    0b000000101001},
-		{"sgei",   0b000000101010},
-		{"cmpi",   0b000000101011},
-		{"time",   0b000000110000},
-		{"timei",  0b000000110001},
-		{"ring",   0b000000110010},
-		{"ringi",  0b000000110011},
-		{"divi",   0b000000110100},
-		{"divui",  0b000000110101},
-		{"divii",  0b000000110110},
-		{"divuii", 0b000000110111},
-		{"sel",    0b000000111000},
-		{"sspush", 0b000000111001},
-		{"sspop",  0b000000111010},
-		{"sgeui",  0b000000111011},
-		{"sgui",   0b000000111100},
-		{"pgon",   0b000000111101},
-		{"pgoff",  0b000000111101},
-		{"setpt",  0b000000111101},
-		{"svpg",   0b000000111101},
-		{"sllii",  0b000000111110},
-		{"srlii",  0b000000111111},
-		{"sraii",  0b000001000000},
-		{"qm",     0b000001000001},
-		{"ei",     0b000001000010},
-		{"di",     0b000001000010},
-		{"modui",  0b000001000011},
-	};
+	static constexpr OpcodeClassTable makeOpcodeClassTable() {
+		OpcodeClassTable table;
+		table.classes[OP_NOP] = OpcodeClass::Nop;
+		for (const Opcode opcode: R_OPCODES)
+			table.classes[opcode] = OpcodeClass::R;
+		for (const Opcode opcode: I_OPCODES)
+			table.classes[opcode] = OpcodeClass::I;
+		for (const Opcode opcode: J_OPCODES)
+			table.classes[opcode] = OpcodeClass::J;
+		return table;
+	}
 
-	std::map<std::string, std::string> UNSIGNED_EQUIVALENTS {
-		{"sgi",   "sgui"  },
-		{"sgei",  "sgeui" },
-		{"sli",   "slui"  },
-		{"slei",  "sleui" },
-		{"mult",  "multu" },
-		{"divi",  "divui" },
-		{"divii", "divuii"},
-		{"multi", "multui"},
-		{"sl",    "slu"   },
-		{"sle",   "sleu"  },
-		{"div",   "divu"  },
-		{"mod",   "modu"  },
-		{"modi",  "modui" },
-	};
+	constexpr OpcodeClassTable OPCODE_CLASSES = makeOpcodeClassTable();
 
-	std::map<std::string, Funct> FUNCTS {
-		{"add",    0b000000000000},
-		{"and",    0b000000000000},
-		{"c",      0b000000000000},
-		{"jr",     0b000000000000},
-		{"sl",     0b000000000000},
-		{"time",   0b000000000000},
-		{"ring",   0b000000000000},
-		{"sel",    0b000000000000},
-		{"pgoff",  0b000000000000},
-		{"qm",     0b000000000000},
-		{"di",     0b000000000000},
-		{"jrc",    0b000000000001},
-		{"l",      0b000000000001},
-		{"nand",   0b000000000001},
-		{"sle",    0b000000000001},
-		{"sub",    0b000000000001},
-		{"pgon",   0b000000000001},
-		{"printr", 0b000000000001},
-		{"ei",     0b000000000001},
-		{"jrl",    0b000000000010},
-		{"mult",   0b000000000010},
-		{"nor",    0b000000000010},
-		{"s",      0b000000000010},
-		{"seq",    0b000000000010},
-		{"setpt",  0b000000000010},
-		{"halt",   0b000000000010},
-		{"cb",     0b000000000011},
-		{"jrlc",   0b000000000011},
-		{"not",    0b000000000011},
-		{"slu",    0b000000000011},
-		{"svpg",   0b000000000011},
-		{"eval",   0b000000000011},
-		{"lb",     0b000000000100},
-		{"or",     0b000000000100},
-		{"sleu",   0b000000000100},
-		{"prc",    0b000000000100},
-		{"cmp",    0b000000000101},
-		{"multu",  0b000000000101},
-		{"sb",     0b000000000101},
-		{"xnor",   0b000000000101},
-		{"prd",    0b000000000101},
-		{"sll",    0b000000000110},
-		{"xor",    0b000000000110},
-		{"spush",  0b000000000110},
-		{"prx",    0b000000000110},
-		{"srl",    0b000000000111},
-		{"spop",   0b000000000111},
-		{"sleep",  0b000000000111},
-		{"ch",     0b000000001000},
-		{"land",   0b000000001000},
-		{"sra",    0b000000001000},
-		{"prb",    0b000000001000},
-		{"lh",     0b000000001001},
-		{"lnand",  0b000000001001},
-		{"mod",    0b000000001001},
-		{"rest",   0b000000001001},
-		{"div",    0b000000001010},
-		{"lnor",   0b000000001010},
-		{"sh",     0b000000001010},
-		{"io",     0b000000001010},
-		{"divu",   0b000000001011},
-		{"lnot",   0b000000001011},
-		{"ms",     0b000000001011},
-		{"cs",     0b000000001100},
-		{"lor",    0b000000001100},
-		{"modu",   0b000000001100},
-		{"sext32", 0b000000001101},
-		{"lxnor",  0b000000001101},
-		{"ls",     0b000000001101},
-		{"lxor",   0b000000001110},
-		{"ss",     0b000000001110},
-		{"sext16", 0b000000001110},
-		{"sext8",  0b000000001111},
-	};
+	static_assert(OPCODE_CLASSES[OP_ADD] == OpcodeClass::R);
+	static_assert(OPCODE_CLASSES[OP_ADDI] == OpcodeClass::I);
+	static_assert(OPCODE_CLASSES[OP_J] == OpcodeClass::J);
+	static_assert(OPCODE_CLASSES[0xfff] == OpcodeClass::Invalid);
 }
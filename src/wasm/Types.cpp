@@ -27,30 +27,30 @@ namespace Wasmc {
 	}
 
 	Long AnyR::encode() const {
-		return uint64_t(function)
-			| (uint64_t(flags) << 12)
-			| (uint64_t(condition) << 14)
-			| (uint64_t(rd) << 31)
-			| (uint64_t(rs) << 38)
-			| (uint64_t(rt) << 45)
-			| (uint64_t(opcode) << 52);
+		return RField::Funct.insert(function)
+			| RField::Flags.insert(flags)
+			| RField::Condition.insert(condition)
+			| RField::Rd.insert(rd)
+			| RField::Rs.insert(rs)
+			| RField::Rt.insert(rt)
+			| OPCODE_FIELD.insert(opcode);
 	}
 
 	Long AnyI::encode() const {
-		return uint64_t(immediate)
-			| (uint64_t(rd) << 32)
-			| (uint64_t(rs) << 39)
-			| (uint64_t(flags) << 46)
-			| (uint64_t(condition) << 48)
-			| (uint64_t(opcode) << 52);
+		return IField::Immediate.insert(immediate)
+			| IField::Rd.insert(rd)
+			| IField::Rs.insert(rs)
+			| IField::Flags.insert(flags)
+			| IField::Condition.insert(condition)
+			| OPCODE_FIELD.insert(opcode);
 	}
 
 	Long AnyJ::encode() const {
-		return uint64_t(immediate)
-			| (uint64_t(flags) << 32)
-			| (uint64_t(condition) << 34)
-			| (uint64_t(link? 1 : 0) << 44)
-			| (uint64_t(rs) << 45)
-			| (uint64_t(opcode) << 52);
+		return JField::Immediate.insert(immediate)
+			| JField::Flags.insert(flags)
+			| JField::Condition.insert(condition)
+			| JField::Link.insert(link? 1 : 0)
+			| JField::Rs.insert(rs)
+			| OPCODE_FIELD.insert(opcode);
 	}
 }